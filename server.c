@@ -1,10 +1,295 @@
+#define _GNU_SOURCE // memmem() and other GNU extensions
+
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/tcp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "server_metrics.h"
+
+#define MAX_BODY_SIZE 4096
+#define MAX_LISTENERS 8
+#define MAX_WORKERS 256
+#define ADMIN_RESPONSE_SIZE 4096
+#define MAX_STATUS_MESSAGE_SIZE 50
+#define MAX_ETAG_SIZE 40
+#define MAX_CACHE_HEADER_SIZE 128
+#define HTTP_DATE_SIZE 30
+#define FINGERPRINT_MIN_DIGITS 8
+#define TEMPLATE_VALUE_SIZE 256
+#define SSI_MAX_SEGMENTS 33
+#define SSI_PAGE_SLOTS 64
+#define TRANSFORMED_SIZE_SLOTS 256
+#define PRELOAD_MAX_LINKS 8
+#define PRELOAD_MAX_URL 256
+#define TAR_BLOCK_SIZE 512
+#define TAR_MAX_NAME 260
+#define SENDFILE_CHUNK (1024 * 1024)
+#define TRACE_HEADER_SIZE 128
+#define REQUEST_LINE_SIZE 64
+#define REQUEST_COUNTER_MASK 0xffffffULL
+#define DISCARD_TIMEOUT_MS 2000
+#define DISCARD_MAX_BYTES (1024 * 1024)
+
+//------------------------------------------------------------------
+/*
+ * USDT probes for perf, bpftrace and SystemTap, compiled in when <sys/sdt.h> (systemtap-sdt-dev)
+ * is available:
+ *
+ *   accept(conn, fd, listener)                        a connection was accepted
+ *   request__parsed(conn, method, path, header_bytes, nsec)  the request line and headers parsed
+ *   route__matched(conn, method, path, route)         a route table lookup (route is "" on a miss)
+ *   response__start(conn, nsec)                       the handler is about to produce the response
+ *   response__done(conn, status, body_bytes, nsec)    the handler has sent the response
+ *   connection__close(conn, status, nsec)             the socket was closed
+ *
+ * conn is the request id, the same one sent as X-Request-Id and written to the access log:
+ * epoch << 32 | worker id << 24 | 24-bit connection count (see TracedConnection), so
+ * conn >> 24 & 0xff is the worker. nsec is the time since accept. An unattached probe is
+ * a single nop. Each probe has a semaphore that tracers set while attached, so the
+ * timestamps are only taken then.
+ *
+ *   bpftrace -e 'usdt:./server:http_server:response__done { @[arg1] = hist(arg3 / 1000); }'
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define DEFINE_PROBE(name) \
+    __extension__ unsigned short http_server_##name##_semaphore __attribute__((unused, section(".probes")))
+#define PROBE_ENABLED(name) __builtin_expect(http_server_##name##_semaphore != 0, 0)
+#define PROBE(name, ...) STAP_PROBEV(http_server, name, __VA_ARGS__)
+DEFINE_PROBE(accept);
+DEFINE_PROBE(request__parsed);
+DEFINE_PROBE(route__matched);
+DEFINE_PROBE(response__start);
+DEFINE_PROBE(response__done);
+DEFINE_PROBE(connection__close);
+#else
+#define PROBE_ENABLED(name) 0
+#define PROBE(name, ...) ((void)0)
+#endif
+
+/**
+ * @brief The connection this worker is handling, as reported to the probes, the access
+ *        log and the client.
+ *
+ * Every connection carries one request, so the connection id doubles as the request id.
+ * It is an epoch in the top 32 bits (the worker's start time), the worker id in the next
+ * 8 and a 24-bit count of the connections the worker has accepted, which makes it unique
+ * across workers and worker restarts without a syscall per request. When the count wraps
+ * the epoch moves on to the current time, or one past the old epoch if that is later.
+ */
+typedef struct {
+    uint64_t id;                        ///< Request id.
+    struct timespec accepted;           ///< When the connection was accepted (CLOCK_MONOTONIC).
+    char id_text[17];                   ///< id as 16 hex digits.
+    char headers[TRACE_HEADER_SIZE];    ///< X-Request-Id, and traceparent if the client sent one, for every response.
+} TracedConnection;
+
+TracedConnection tracedConnection;
+
+/**
+ * @brief Nanoseconds since the current connection was accepted, for probe arguments.
+ */
+long nanosecondsSinceAccept(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - tracedConnection.accepted.tv_sec) * 1000000000L +
+           (now.tv_nsec - tracedConnection.accepted.tv_nsec);
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief What a worker is doing, as shown by /debug/connections.
+ */
+typedef enum {
+    CONNECTION_IDLE = 0,        ///< No connection: waiting for one.
+    CONNECTION_READING_HEADERS, ///< Receiving the request line and headers.
+    CONNECTION_READING_BODY,    ///< Receiving the request body.
+    CONNECTION_WRITING,         ///< Handling the request and sending the response.
+} ConnectionState;
+
+/**
+ * @brief The TCP_INFO figures shown by /debug/connections.
+ */
+typedef struct {
+    uint32_t rtt_usec;        ///< Smoothed round-trip time.
+    uint32_t rttvar_usec;     ///< Round-trip time variance.
+    uint32_t retransmits;     ///< Retransmissions of the segment currently unacknowledged.
+    uint32_t total_retrans;   ///< Retransmissions over the connection's life.
+    uint32_t snd_cwnd;        ///< Congestion window in segments.
+    uint64_t bytes_acked;     ///< Bytes the peer has acknowledged.
+    uint64_t bytes_received;  ///< Bytes received from the peer.
+    struct timespec sampled;  ///< When the figures were taken (CLOCK_MONOTONIC; zero = never).
+} TcpStats;
+
+/**
+ * @brief Copy the interesting fields of a TCP_INFO sample taken at sampled.
+ */
+void fillTcpStats(TcpStats *stats, const struct tcp_info *info, const struct timespec *sampled) {
+    stats->rtt_usec = info->tcpi_rtt;
+    stats->rttvar_usec = info->tcpi_rttvar;
+    stats->retransmits = info->tcpi_retransmits;
+    stats->total_retrans = info->tcpi_total_retrans;
+    stats->snd_cwnd = info->tcpi_snd_cwnd;
+    stats->bytes_acked = info->tcpi_bytes_acked;
+    stats->bytes_received = info->tcpi_bytes_received;
+    stats->sampled = *sampled;
+}
+
+/**
+ * @brief A worker's entry in the shared connection table.
+ *
+ * Workers serve one connection at a time, so the table has a slot per worker. The worker
+ * is the only writer of its slot and brackets every change with a seqlock: sequence is
+ * odd while the slot changes, and a reader in another worker copies the slot and retries
+ * if sequence moved. Readers never make the writer wait.
+ */
+typedef struct {
+    _Alignas(64) _Atomic uint32_t sequence; ///< Seqlock counter, odd during an update.
+    ConnectionState state;                  ///< What the worker is doing.
+    pid_t pid;                              ///< The worker process.
+    int fd;                                 ///< The connection's socket in the worker (-1 when idle).
+    uint64_t request_id;                    ///< Id of the connection's request.
+    struct timespec since;                  ///< Accept time, or when the worker went idle (CLOCK_MONOTONIC).
+    size_t bytes_received;                  ///< Request bytes received so far.
+    size_t bytes_sent;                      ///< Response bytes (interim responses included) sent so far.
+    TcpStats tcp;                           ///< TCP_INFO as last published by the worker itself.
+    struct sockaddr_storage peer;           ///< The client's address.
+    char request_line[REQUEST_LINE_SIZE];   ///< Start of the request line, once the headers are in.
+} ConnectionSlot;
+
+/**
+ * @brief The shared connection table, mapped before the workers are forked.
+ */
+ConnectionSlot *connectionTable = NULL;
+int connectionTableSize = 0;
+
+/**
+ * @brief This worker's slot in connectionTable, or NULL when there is no table.
+ */
+ConnectionSlot *connectionSlot = NULL;
+
+/**
+ * @brief Open an update of this worker's slot.
+ *
+ * @return The slot, or NULL when there is no connection table.
+ */
+static inline ConnectionSlot *beginSlotUpdate(void) {
+    ConnectionSlot *slot = connectionSlot;
+    if (slot != NULL) {
+        atomic_store_explicit(&slot->sequence, atomic_load_explicit(&slot->sequence, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+    return slot;
+}
+
+/**
+ * @brief Publish an update opened with beginSlotUpdate.
+ */
+static inline void endSlotUpdate(ConnectionSlot *slot) {
+    atomic_store_explicit(&slot->sequence, atomic_load_explicit(&slot->sequence, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+/**
+ * @brief Move this worker's connection to another state.
+ *
+ * @param state The new state.
+ * @param received Request bytes received since the last update.
+ */
+void updateConnectionSlot(ConnectionState state, size_t received) {
+    ConnectionSlot *slot = beginSlotUpdate();
+    if (slot != NULL) {
+        slot->state = state;
+        slot->bytes_received += received;
+        endSlotUpdate(slot);
+    }
+}
+
+/**
+ * @brief Whether workers publish TCP_INFO of their connection in their slot.
+ *
+ * Set when an admin listener serves /debug/connections. Reading another worker's socket
+ * directly needs pidfd_getfd(), which Yama's default ptrace_scope of 1 refuses between
+ * sibling workers, so each worker also keeps a recent sample of its own socket.
+ */
+int tcpStatsPublished = 0;
+
+/**
+ * @brief Take a TCP_INFO sample of this worker's connection, if workers publish them.
+ *
+ * @return 1 if stats was filled, 0 otherwise.
+ */
+int sampleOwnTcpStats(TcpStats *stats) {
+    const ConnectionSlot *slot = connectionSlot;
+    if (!tcpStatsPublished || slot == NULL || slot->fd == -1 || slot->peer.ss_family == AF_UNIX) {
+        return 0;
+    }
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    if (getsockopt(slot->fd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fillTcpStats(stats, &info, &now);
+    return 1;
+}
+
+/**
+ * @brief Count bytes written to this worker's connection and refresh its TCP sample.
+ *
+ * @param sent The result of the send call; errors (-1) are ignored.
+ */
+void countBytesSent(ssize_t sent) {
+    if (sent <= 0 || connectionSlot == NULL) {
+        return;
+    }
+    TcpStats stats;
+    int sampled = sampleOwnTcpStats(&stats);
+    ConnectionSlot *slot = beginSlotUpdate();
+    slot->bytes_sent += sent;
+    if (sampled) {
+        slot->tcp = stats;
+    }
+    endSlotUpdate(slot);
+}
 
 //------------------------------------------------------------------
 /**
@@ -83,342 +368,5627 @@ char *ReadFile(const char *filename, long *size) {
 }
 
 //------------------------------------------------------------------
-#define MAX_METHOD_SIZE 10
-#define MAX_PATH_SIZE 100
-#define MAX_BODY_SIZE 4096
-#define MAX_STATUS_MESSAGE_SIZE 50
-
 /**
- * @brief Structure representing an HTTP request.
+ * @brief Runtime options that tune how the server waits for and handles connections.
  *
- * This structure stores information about an HTTP request, including the HTTP method,
- * the request path, and, if applicable, the request body.
+ * The defaults reproduce the classic behaviour: the accept loop sleeps in the kernel
+ * until a connection arrives. Setting a busy-poll budget trades CPU for latency by
+ * letting the loop spin on the socket instead of sleeping.
  */
 typedef struct {
-    char method[MAX_METHOD_SIZE]; ///< The HTTP method (e.g., "GET").
-    char path[MAX_PATH_SIZE];     ///< The request path (e.g., "/index.html").
-    char *body;                   ///< Pointer to the request body (may be NULL if not present).
-    size_t body_size;             ///< Size of the request body (0 if not present).
-} HttpRequest;
+    int busy_poll_usec;   ///< SO_BUSY_POLL value applied to every socket (0 disables busy polling).
+    int spin_budget_usec; ///< How long to spin on a non-blocking epoll_wait before blocking (-1 = same as busy_poll_usec).
+    int cache_size_mb;    ///< Size of the static file cache in megabytes (0 disables the cache).
+    int huge_pages;       ///< Back the file cache and buffer pool with 2 MB huge pages when available.
+    int workers;          ///< Number of prefork worker processes (0 = serve from a single process).
+    const char *cache_snapshot; ///< File the file cache is restored from and saved to (NULL = none).
+    int snapshot_interval;      ///< Seconds between periodic cache snapshots (0 = only on shutdown).
+    const char *access_log;     ///< File requests are logged to in Common Log Format (NULL = no log).
+    const char *prewarm_source; ///< Access log or capture file to prewarm the cache from (NULL = none).
+    const char *replay_source;  ///< Access log or capture file to replay against the cache, then exit (NULL = serve).
+    int prewarm_count;          ///< Maximum number of distinct paths to prewarm.
+    int max_uri_length;         ///< Longest request path accepted; longer ones get 414 URI Too Long.
+    int max_header_size;        ///< Largest request header block accepted; larger ones get 431.
+    int max_headers;            ///< Most request headers accepted; more get 431.
+    int max_body_size;          ///< Largest request body accepted by routes without their own limit; larger ones get 413.
+    const char *template_dir;   ///< Directory whose "*.tmpl" files are compiled and served as pages.
+    int minify;                 ///< Strip whitespace from HTML, CSS and JavaScript when they are loaded.
+    const char *archive;        ///< Tar archive whose members are served as static files (NULL = none).
+    const char *listen[MAX_LISTENERS]; ///< Listen addresses besides the one given by the positional arguments.
+    int listen_count;           ///< Number of entries in listen.
+    int early_hints;            ///< Send 103 Early Hints preloading an HTML page's stylesheets and scripts.
+    int degraded_load;          ///< Busy percentage at which /healthz reports 503 (0 = never degraded).
+    const char *metrics_file;   ///< File the counters are mapped to for server-stats (NULL = none).
+} ServerOptions;
 
 /**
- * @brief Structure representing an HTTP response.
- *
- * This structure stores information about an HTTP response, including the HTTP status code,
- * status message, content length, and the response content.
+ * @brief Global server options, filled in from the command line by main().
  */
-typedef struct {
-    int status_code;            ///< The HTTP status code (e.g., 200, 404).
-    char status_message[MAX_STATUS_MESSAGE_SIZE];    ///< The HTTP status message (e.g., "OK", "Not Found").
-    size_t content_length;      ///< The length of the response content.
-    char *content;              ///< Pointer to the response content.
-} HttpResponse;
+ServerOptions serverOptions = {
+    .busy_poll_usec = 0,
+    .spin_budget_usec = -1,
+    .cache_size_mb = 64,
+    .huge_pages = 1,
+    .workers = 0,
+    .cache_snapshot = NULL,
+    .snapshot_interval = 0,
+    .access_log = NULL,
+    .prewarm_source = NULL,
+    .replay_source = NULL,
+    .prewarm_count = 100,
+    .max_uri_length = 2048,
+    .max_header_size = 16384,
+    .max_headers = 64,
+    .max_body_size = MAX_BODY_SIZE,
+    .template_dir = "./public_html",
+    .minify = 0,
+    .archive = NULL,
+    .listen_count = 0,
+    .early_hints = 0,
+    .degraded_load = 90,
+    .metrics_file = NULL,
+};
 
 /**
- * @brief Structure representing a route mapping for an HTTP server.
- *
- * This structure is used to map URL paths to corresponding resources or files.
- * It also allows for associating optional callback functions to handle requests
- * for specific routes.
+ * @brief Index of this worker process (0 in single-process mode).
  */
-typedef struct {
-    char path[MAX_PATH_SIZE];       ///< The URL path to match.
-    char link[MAX_PATH_SIZE];       ///< The corresponding file or resource path.
-    void (*callback)(HttpRequest); ///< Optional callback function to handle requests for this route.
-} RouteMapping;
-
+int workerId = 0;
 
 /**
- * @brief Global array of GET method route mappings for the HTTP server.
+ * @brief Parse a "--name=<integer>" command line option.
  *
- * This array defines the routes and associated resources for handling HTTP GET requests.
- * Each element in the array represents a route mapping, consisting of a URL path,
- * a corresponding file path, and an optional callback function.
+ * @param arg The command line argument to inspect.
+ * @param prefix The option prefix including the '=' (e.g. "--busy-poll=").
+ * @param value Where the parsed value is stored when the prefix matches.
+ * @return 1 if the option matched and was parsed, 0 if the prefix does not match,
+ *         -1 if the prefix matches but the value is not a non-negative integer.
  */
-RouteMapping getRouteMappings[] = {
-    {"/", "./public_html/index.html", NULL},
-    {"/test", "./public_html/test.html", NULL},
-    // Add more route mappings as needed
-};
+int parseIntOption(const char *arg, const char *prefix, int *value) {
+    size_t prefix_length = strlen(prefix);
+    if (strncmp(arg, prefix, prefix_length) != 0) {
+        return 0;
+    }
+
+    char *end;
+    long parsed = strtol(arg + prefix_length, &end, 10);
+    if (*end != '\0' || end == arg + prefix_length || parsed < 0 || parsed > 1000000000) {
+        return -1;
+    }
+    *value = (int)parsed;
+    return 1;
+}
 
 /**
- * @brief Parse an HTTP request string and create an HttpRequest structure.
- *
- * This function takes an HTTP request string and extracts information such as the HTTP method,
- * request path, and request body size and content. It creates and initializes an HttpRequest structure
- * with the parsed data.
+ * @brief Apply a single optional command line argument to serverOptions.
  *
- * @param request The HTTP request string to parse.
- * @return A pointer to the created and populated HttpRequest structure. The caller is responsible for freeing
- * the memory allocated for the structure when it's no longer needed. Returns NULL if parsing fails
- * or if the input is invalid.
+ * @param arg The command line argument (e.g. "--busy-poll=50").
+ * @return 0 on success, -1 if the option is unknown or malformed.
  */
-HttpRequest* parseHttpRequest(const char* request) {
-    if (request == NULL) {
-        // Handle invalid input
-        return NULL;
+int parseServerOption(const char *arg) {
+    int matched;
+    if ((matched = parseIntOption(arg, "--busy-poll=", &serverOptions.busy_poll_usec)) != 0) {
+        return matched == 1 ? 0 : -1;
     }
-
-    HttpRequest *http = malloc(sizeof(HttpRequest));
-    if (http == NULL) {
-        fprintf(stderr, "Allocation in parseHttpRequest: %s\n", strerror(errno));
-        return NULL;
+    if ((matched = parseIntOption(arg, "--spin-budget=", &serverOptions.spin_budget_usec)) != 0) {
+        return matched == 1 ? 0 : -1;
     }
-
-    char* method;
-    char* path;
-    char* start;
-
-    // Initialize the HTTP struct
-    memset(http, 0, sizeof(HttpRequest));
-
-    // Create a copy of the request string
-    char *request_copy = strdup(request);
-    if (request_copy == NULL) {
-        fprintf(stderr, "Allocation in parseHttpRequest: %s\n", strerror(errno));
-        free(http);
-        return NULL;
+    if ((matched = parseIntOption(arg, "--cache-size=", &serverOptions.cache_size_mb)) != 0) {
+        return matched == 1 ? 0 : -1;
+    }
+    if ((matched = parseIntOption(arg, "--workers=", &serverOptions.workers)) != 0) {
+        return matched == 1 ? 0 : -1;
+    }
+    if ((matched = parseIntOption(arg, "--snapshot-interval=", &serverOptions.snapshot_interval)) != 0) {
+        return matched == 1 ? 0 : -1;
+    }
+    if ((matched = parseIntOption(arg, "--prewarm-count=", &serverOptions.prewarm_count)) != 0) {
+        return matched == 1 ? 0 : -1;
+    }
+    if ((matched = parseIntOption(arg, "--max-uri=", &serverOptions.max_uri_length)) != 0) {
+        return matched == 1 ? 0 : -1;
+    }
+    if ((matched = parseIntOption(arg, "--max-header-size=", &serverOptions.max_header_size)) != 0) {
+        return matched == 1 ? 0 : -1;
     }
+    if ((matched = parseIntOption(arg, "--max-headers=", &serverOptions.max_headers)) != 0) {
+        return matched == 1 ? 0 : -1;
+    }
+    if ((matched = parseIntOption(arg, "--max-body=", &serverOptions.max_body_size)) != 0) {
+        return matched == 1 ? 0 : -1;
+    }
+    if ((matched = parseIntOption(arg, "--degraded-load=", &serverOptions.degraded_load)) != 0) {
+        return matched == 1 && serverOptions.degraded_load <= 100 ? 0 : -1;
+    }
+    if (strncmp(arg, "--cache-snapshot=", 17) == 0 && arg[17] != '\0') {
+        serverOptions.cache_snapshot = arg + 17;
+        return 0;
+    }
+    if (strncmp(arg, "--access-log=", 13) == 0 && arg[13] != '\0') {
+        serverOptions.access_log = arg + 13;
+        return 0;
+    }
+    if (strncmp(arg, "--prewarm-from=", 15) == 0 && arg[15] != '\0') {
+        serverOptions.prewarm_source = arg + 15;
+        return 0;
+    }
+    if (strncmp(arg, "--listen=", 9) == 0 && arg[9] != '\0' && serverOptions.listen_count + 1 < MAX_LISTENERS) {
+        serverOptions.listen[serverOptions.listen_count++] = arg + 9;
+        return 0;
+    }
+    if (strncmp(arg, "--metrics-file=", 15) == 0 && arg[15] != '\0') {
+        serverOptions.metrics_file = arg + 15;
+        return 0;
+    }
+    if (strncmp(arg, "--archive=", 10) == 0 && arg[10] != '\0') {
+        serverOptions.archive = arg + 10;
+        return 0;
+    }
+    if (strncmp(arg, "--templates=", 12) == 0 && arg[12] != '\0') {
+        serverOptions.template_dir = arg + 12;
+        return 0;
+    }
+    if (strncmp(arg, "--replay=", 9) == 0 && arg[9] != '\0') {
+        serverOptions.replay_source = arg + 9;
+        return 0;
+    }
+    if (strcmp(arg, "--no-huge-pages") == 0) {
+        serverOptions.huge_pages = 0;
+        return 0;
+    }
+    if (strcmp(arg, "--minify") == 0) {
+        serverOptions.minify = 1;
+        return 0;
+    }
+    if (strcmp(arg, "--early-hints") == 0) {
+        serverOptions.early_hints = 1;
+        return 0;
+    }
+    return -1;
+}
+
+//------------------------------------------------------------------
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
 
-    method = strtok(request_copy, " ");
-    path = strtok(NULL, " ");
-    if (method && path) {
-        strncpy(http->method, method, sizeof(http->method) - 1);
-        strncpy(http->path, path, sizeof(http->path) - 1);
+/**
+ * @brief How the memory of a HugePageRegion is backed.
+ */
+typedef enum {
+    PAGES_REGULAR = 0,  ///< Ordinary 4 KB pages.
+    PAGES_TRANSPARENT,  ///< Regular mapping marked with MADV_HUGEPAGE (transparent huge pages).
+    PAGES_EXPLICIT      ///< Explicit MAP_HUGETLB pages from the reserved huge page pool.
+} PageBacking;
 
-        // Parse Content-Length header
-        start = strstr(request, "Content-Length:");
-        if (start) {
-            sscanf(start, "Content-Length: %zu", &http->body_size);
+/**
+ * @brief A contiguous anonymous memory region, preferably backed by 2 MB huge pages.
+ *
+ * Large, long-lived data such as the file cache is touched all over on every request.
+ * Spread over 4 KB pages it needs hundreds of TLB entries; on 2 MB pages a few suffice.
+ */
+typedef struct {
+    char *base;          ///< Start of the region (aligned to HUGE_PAGE_SIZE).
+    size_t size;         ///< Size of the region in bytes (a multiple of HUGE_PAGE_SIZE).
+    PageBacking backing; ///< Which kind of pages ended up backing the region.
+} HugePageRegion;
 
-            start = strstr(request, "\r\n\r\n");
-            if (start) {
-                start += 4;
-                size_t available_space = sizeof(http->body) - 1; // Leave space for null terminator
-                size_t copy_size = http->body_size < available_space ? http->body_size : available_space;
-                strncpy(http->body, start, copy_size);
-                http->body[copy_size] = '\0'; // Null-terminate the body
-            }
-        }
+/**
+ * @brief Human readable name of a PageBacking value, for startup messages.
+ */
+const char *pageBackingName(PageBacking backing) {
+    switch (backing) {
+        case PAGES_EXPLICIT: return "explicit huge pages";
+        case PAGES_TRANSPARENT: return "transparent huge pages";
+        default: return "regular pages";
     }
-
-    free(request_copy);
-    return http;
 }
 
-
 /**
- * @brief Convert an HttpResponse struct to an HTTP response string.
+ * @brief Map a memory region, trying explicit huge pages, then transparent huge pages.
  *
- * This function takes an HttpResponse struct and converts it into a well-formed
- * HTTP response string. The resulting string includes the HTTP status code,
- * status message, content length, content type, and the response content.
+ * Explicit huge pages (MAP_HUGETLB) only work when the administrator reserved some via
+ * vm.nr_hugepages. Otherwise the region is mapped normally, aligned to a 2 MB boundary
+ * and marked with MADV_HUGEPAGE so khugepaged can collapse it. If huge pages are
+ * disabled in serverOptions or unavailable, the region uses regular pages.
  *
- * @param response Pointer to the HttpResponse struct to be converted.
- * @param size Pointer to a long variable to store the size of the generated string (optional).
- * @return A dynamically allocated string representing the HTTP response. The caller is responsible
- * for freeing the memory when it's no longer needed. Returns NULL on allocation failure.
+ * @param size The requested size in bytes; it is rounded up to a multiple of HUGE_PAGE_SIZE.
+ * @param shared Non-zero to map MAP_SHARED, so processes forked later share the memory.
+ * @param region The region descriptor to fill in.
+ * @return 0 on success, -1 if no memory could be mapped.
  */
-char* HttpResponseToString(const HttpResponse *response, long *size) {
-    int total_length = snprintf(NULL, 0, "HTTP/1.1 %d %s\r\nContent-Type: text/html;charset=UTF-8\r\nContent-Length: %zu\r\n\r\n%s",
-        response->status_code, response->status_message, response->content_length, response->content);
+int allocateHugePageRegion(size_t size, int shared, HugePageRegion *region) {
+    int visibility = shared ? MAP_SHARED : MAP_PRIVATE;
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    memset(region, 0, sizeof(*region));
+    region->size = size;
 
-    if (total_length < 0) {
-        // Handle snprintf error
-        fprintf(stderr, "Error in snprintf\n");
-        free(response->content);
-        return NULL;
+#ifdef MAP_HUGETLB
+    if (serverOptions.huge_pages) {
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            visibility | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            region->base = memory;
+            region->backing = PAGES_EXPLICIT;
+            return 0;
+        }
     }
+#endif
 
-    char *http_response = malloc(total_length + 1);
-    if (http_response == NULL) {
-        // Handle memory allocation failure
-        fprintf(stderr, "Memory allocation error in HttpResponseToString\n");
-        free(response->content);
-        return NULL;
+    // Over-allocate so the region can start on a huge page boundary, then trim
+    size_t mapped_size = size + (serverOptions.huge_pages ? HUGE_PAGE_SIZE : 0);
+    char *memory = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                        visibility | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %zu bytes: %s\n", size, strerror(errno));
+        return -1;
     }
-
-    snprintf(http_response, total_length + 1, "HTTP/1.1 %d %s\r\nContent-Type: text/html;charset=UTF-8\r\nContent-Length: %zu\r\n\r\n%s",
-        response->status_code, response->status_message, response->content_length, response->content);
-
-    if (size != NULL) {
-        *size = total_length;
+    char *aligned = (char *)(((uintptr_t)memory + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (!serverOptions.huge_pages) {
+        aligned = memory;
+    }
+    if (aligned > memory) {
+        munmap(memory, aligned - memory);
+    }
+    size_t tail = (memory + mapped_size) - (aligned + size);
+    if (tail > 0) {
+        munmap(aligned + size, tail);
     }
 
-    return http_response;
+    region->base = aligned;
+    region->backing = PAGES_REGULAR;
+#ifdef MADV_HUGEPAGE
+    if (serverOptions.huge_pages && madvise(aligned, size, MADV_HUGEPAGE) == 0) {
+        region->backing = PAGES_TRANSPARENT;
+    }
+#endif
+    return 0;
 }
 
+//------------------------------------------------------------------
+#define CONNECTION_BUFFER_SIZE 32768
+#define CONNECTION_BUFFER_COUNT 64
+
 /**
- * @brief Handle an HTTP GET request and send an appropriate response.
- *
- * This function processes an HTTP GET request, attempts to match the request path to configured routes,
- * and sends a corresponding HTTP response. If a matching route is found, it reads the content from
- * the specified file and sends a "200 OK" response with the content. If no matching route is found,
- * it sends a "404 Not Found" response.
+ * @brief A pool of fixed-size connection buffers carved out of one huge page region.
  *
- * @param client_socket The socket connected to the client.
- * @param request Pointer to the HttpRequest structure representing the request.
+ * Buffers are handed out from a free stack, so the most recently released (and most
+ * likely still cached) buffer is reused first. When the pool runs dry, buffers fall
+ * back to malloc.
  */
-void handleGetRequest(int client_socket, const HttpRequest *request) {
-    HttpResponse response;
-    long size = 0;
-    response.status_code = 404;
-    strcpy(response.status_message, "Not Found");
-    response.content_length = size;
-    response.content = malloc(1);
-    strcpy(response.content, "");
-
-    for (size_t i = 0; i < (sizeof(getRouteMappings) / sizeof(RouteMapping)); i++) {
-        if (strncmp(request->path, getRouteMappings[i].path, MAX_PATH_SIZE) == 0) {
-            response.status_code = 200;
-            strcpy(response.status_message, "OK");
-            char *content = ReadFile(getRouteMappings[i].link, &size);
-            if (content != NULL) {
-                response.content_length = size;
-                free(response.content);
-                response.content = content;
-            } else {
-                // Handle file read error, e.g., by sending a 500 Internal Server Error response
-                response.status_code = 500;
-                strcpy(response.status_message, "Internal Server Error");
-            }
-            break; // Stop searching for routes once a match is found
-        }
-    }
-
-    char *response_message = HttpResponseToString(&response, &size); // Don't need the size here
-    ssize_t bytes_sent = send(client_socket, response_message, size, 0);
+typedef struct {
+    HugePageRegion region;                      ///< Memory backing all pooled buffers.
+    char *free_buffers[CONNECTION_BUFFER_COUNT]; ///< Stack of buffers ready for use.
+    int free_count;                              ///< Number of entries in free_buffers.
+} BufferPool;
 
-    free(response.content); // Free content memory
+/**
+ * @brief Global pool of connection receive buffers.
+ */
+BufferPool bufferPool;
 
-    if (bytes_sent == -1) {
-        fprintf(stderr, "Error sending response: %s\n", strerror(errno));
+/**
+ * @brief Map the buffer pool region and fill the free stack.
+ *
+ * @return 0 on success, -1 if the region could not be mapped (buffers then come from malloc).
+ */
+int initBufferPool(BufferPool *pool) {
+    memset(pool, 0, sizeof(*pool));
+    if (allocateHugePageRegion((size_t)CONNECTION_BUFFER_SIZE * CONNECTION_BUFFER_COUNT, 0, &pool->region) == -1) {
+        return -1;
     }
-    printf("Response Sent: \n");
-    printStringWithEscapeChars(response_message);
-    free(response_message);
+    for (int i = CONNECTION_BUFFER_COUNT - 1; i >= 0; i--) {
+        pool->free_buffers[pool->free_count++] = pool->region.base + (size_t)i * CONNECTION_BUFFER_SIZE;
+    }
+    return 0;
 }
 
-
 /**
- * @brief Handle an HTTP request and route it based on the request method.
- *
- * This function dispatches the HTTP request to specific handling functions based on the request method.
+ * @brief Take a CONNECTION_BUFFER_SIZE byte buffer from the pool.
  *
- * @param client_socket The socket connected to the client.
- * @param request Pointer to the HttpRequest structure representing the request.
+ * @return A buffer to be handed back with releaseBuffer(), or NULL on allocation failure.
+ */
+char *acquireBuffer(BufferPool *pool) {
+    if (pool->free_count > 0) {
+        return pool->free_buffers[--pool->free_count];
+    }
+    return malloc(CONNECTION_BUFFER_SIZE);
+}
+
+/**
+ * @brief Return a buffer obtained from acquireBuffer().
  */
-void handleHttpRequest(int client_socket, const HttpRequest* request) {
-    if (strncmp(request->method, "GET", 3) == 0) {
-        handleGetRequest(client_socket, request);
+void releaseBuffer(BufferPool *pool, char *buffer) {
+    if (buffer >= pool->region.base && buffer < pool->region.base + pool->region.size) {
+        pool->free_buffers[pool->free_count++] = buffer;
     } else {
-        // Handle unsupported methods or other errors here
-        fprintf(stderr, "Unsupported HTTP method: %s\n", request->method);
+        free(buffer);
     }
 }
 
+//------------------------------------------------------------------
 /**
- * @brief Start an HTTP server that listens on a specified IP address and port.
+ * @brief Strip indentation, trailing whitespace and blank lines from text, in place.
  *
- * This function creates a TCP socket, binds it to the specified IP address and port, and listens
- * for incoming connections. When a client connects, it accepts the connection, receives HTTP
- * requests, and dispatches them to a handler function for processing.
+ * Line breaks are kept, so JavaScript's automatic semicolon insertion and anything
+ * else that depends on them still sees the same lines.
  *
- * @param addr The IP address to bind the server to.
- * @param port The port number to listen on.
- * @return 0 on success, -1 on failure.
+ * @return The new size of the text.
  */
-int startHttpServer(in_addr_t addr, uint16_t port) {
-    // Create a TCP socket and set up server configuration
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        fprintf(stderr, "Failed to create server socket\n");
-        return -1;
+size_t stripLineWhitespace(char *text, size_t size) {
+    size_t out = 0;
+    size_t i = 0;
+    while (i < size) {
+        while (i < size && (text[i] == ' ' || text[i] == '\t')) {
+            i++;
+        }
+        size_t line_start = out;
+        while (i < size && text[i] != '\n') {
+            text[out++] = text[i++];
+        }
+        while (out > line_start && isspace((unsigned char)text[out - 1])) {
+            out--;
+        }
+        if (i < size && out > line_start) {
+            text[out++] = '\n';
+        }
+        i++;
     }
+    text[out] = '\0';
+    return out;
+}
 
-    // Bind the socket to the specified IP address and port
-    struct sockaddr_in server_address;
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = port;
-    server_address.sin_addr.s_addr = addr;
+/**
+ * @brief Check whether CSS or JavaScript may have a string that spans lines.
+ *
+ * Template literals and backslash line continuations keep their indentation.
+ */
+int mayHaveMultilineString(const char *text, size_t size) {
+    return memchr(text, '`', size) != NULL || memmem(text, size, "\\\n", 2) != NULL;
+}
 
-    if (bind(server_socket, (struct sockaddr *)&server_address,
-             sizeof(server_address)) == -1) {
-        fprintf(stderr, "Failed to bind server socket\n");
-        close(server_socket);
-        return -1;
+/**
+ * @brief Minify HTML unless it has elements whose whitespace is significant.
+ *
+ * Inline <script> and <style> elements are held to the same rule as .js and .css
+ * files in minifyScript().
+ */
+size_t minifyHtml(char *text, size_t size) {
+    if (strcasestr(text, "<pre") != NULL || strcasestr(text, "<textarea") != NULL) {
+        return size;
+    }
+    static const char *const elements[][2] = {{"<script", "</script"}, {"<style", "</style"}};
+    for (size_t i = 0; i < sizeof(elements) / sizeof(elements[0]); i++) {
+        for (const char *start = strcasestr(text, elements[i][0]); start != NULL;
+             start = strcasestr(start, elements[i][0])) {
+            const char *end = strcasestr(start, elements[i][1]);
+            size_t length = (end != NULL ? end : text + size) - start;
+            if (mayHaveMultilineString(start, length)) {
+                return size;
+            }
+            start += length;
+        }
     }
+    return stripLineWhitespace(text, size);
+}
 
-    // Listen for incoming connections
-    if (listen(server_socket, 10) == -1) {
-        fprintf(stderr, "Failed to listen on server socket\n");
+/**
+ * @brief Minify CSS or JavaScript unless a string may span lines.
+ */
+size_t minifyScript(char *text, size_t size) {
+    if (mayHaveMultilineString(text, size)) {
+        return size;
+    }
+    return stripLineWhitespace(text, size);
+}
+
+/**
+ * @brief Load-time transforms of static files, by extension.
+ *
+ * A transform rewrites the contents in place and returns their new size, which may
+ * only shrink. It runs once when the file is read from disk, before the file enters
+ * the cache, so responses never pay for it.
+ */
+static const struct {
+    const char *extension;
+    size_t (*transform)(char *text, size_t size);
+} assetTransforms[] = {
+    {".html", minifyHtml},
+    {".htm", minifyHtml},
+    {".css", minifyScript},
+    {".js", minifyScript},
+};
+
+/**
+ * @brief Find the transform applied to a file when it is loaded.
+ *
+ * @return The transform, or NULL if the file is served as it is on disk.
+ */
+size_t (*findAssetTransform(const char *path))(char *, size_t) {
+    if (!serverOptions.minify) {
+        return NULL;
+    }
+    const char *extension = strrchr(path, '.');
+    if (extension == NULL || strchr(extension, '/') != NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(assetTransforms) / sizeof(assetTransforms[0]); i++) {
+        if (strcasecmp(extension, assetTransforms[i].extension) == 0) {
+            return assetTransforms[i].transform;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief The size a transformed file is served with, valid for one size and mtime of the file.
+ */
+typedef struct {
+    char *path;         ///< File path (NULL = empty slot).
+    size_t file_size;   ///< Size of the file on disk.
+    time_t mtime;       ///< Modification time of the file.
+    size_t served_size; ///< Size of the contents after the transform.
+} TransformedSize;
+
+/**
+ * @brief Served sizes of the transformed files this process has loaded, by path hash.
+ *
+ * HEAD answers from here, since working the size out again would mean loading and
+ * transforming the whole file.
+ */
+TransformedSize transformedSizes[TRANSFORMED_SIZE_SLOTS];
+
+uint64_t hashString(const char *str);
+
+/**
+ * @brief Read a static file and apply its load-time transform.
+ *
+ * Same contract as ReadFile(); used wherever file contents are loaded to be served.
+ * The served size of a transformed file is remembered for statAssetFile().
+ */
+char *loadAssetFile(const char *path, long *size) {
+    char *contents = ReadFile(path, size);
+    size_t (*transform)(char *, size_t) = findAssetTransform(path);
+    if (contents == NULL || transform == NULL) {
+        return contents;
+    }
+    long file_size = *size;
+    *size = transform(contents, *size);
+
+    struct stat file_stat;
+    if (stat(path, &file_stat) == -1 || file_stat.st_size != file_size) {
+        return contents; // Changed while it was read; the next load records it
+    }
+    TransformedSize *known = &transformedSizes[hashString(path) % TRANSFORMED_SIZE_SLOTS];
+    if (known->path == NULL || strcmp(known->path, path) != 0) {
+        char *copy = strdup(path);
+        if (copy == NULL) {
+            return contents;
+        }
+        free(known->path);
+        known->path = copy;
+    }
+    known->file_size = file_size;
+    known->mtime = file_stat.st_mtime;
+    known->served_size = *size;
+    return contents;
+}
+
+/**
+ * @brief Get the size a file is served with and its mtime, without the cache.
+ *
+ * Any file only needs a stat(). The served size of a transformed file is only known
+ * once this process has loaded that version of it; the file is not loaded for it.
+ *
+ * @return 0 on success, 1 if the file exists but its served size is not known yet
+ *         (size is then the size on disk), -1 if the file cannot be read.
+ */
+int statAssetFile(const char *path, size_t *size, time_t *mtime) {
+    struct stat file_stat;
+    if (stat(path, &file_stat) == -1) {
+        return -1;
+    }
+    *size = file_stat.st_size;
+    *mtime = file_stat.st_mtime;
+    if (findAssetTransform(path) == NULL) {
+        return 0;
+    }
+    const TransformedSize *known = &transformedSizes[hashString(path) % TRANSFORMED_SIZE_SLOTS];
+    if (known->path == NULL || strcmp(known->path, path) != 0 || known->file_size != (size_t)file_stat.st_size ||
+        known->mtime != file_stat.st_mtime) {
+        return 1;
+    }
+    *size = known->served_size;
+    return 0;
+}
+
+//------------------------------------------------------------------
+#define FILE_CACHE_SHARDS 8
+#define FILE_CACHE_SHARD_SLOTS 256
+#define FILE_CACHE_REVALIDATE_SECONDS 1
+#define FILE_CACHE_READ_RETRIES 64
+#define FILE_CACHE_TOMBSTONE UINT64_MAX
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 8192
+#define SKETCH_MAX_COUNT 15
+#define SKETCH_SAMPLE_SIZE (10 * FILE_CACHE_SHARDS * FILE_CACHE_SHARD_SLOTS)
+#define FILE_CACHE_PIN_OWNERS (MAX_WORKERS + 1)
+
+/**
+ * @brief The description of a cached file. Offsets are relative to the cache data area.
+ *
+ * The path and the contents are stored back to back, so an entry occupies the extent
+ * [key_offset, data_offset + size) of its shard's part of the data area.
+ */
+typedef struct {
+    uint64_t hash;      ///< FNV-1a hash of the file path (0 = empty slot, FILE_CACHE_TOMBSTONE = removed).
+    size_t key_offset;  ///< Offset of the NUL-terminated file path.
+    size_t data_offset; ///< Offset of the file contents.
+    size_t size;        ///< Size of the file contents in bytes.
+    size_t file_size;   ///< Size of the file on disk, which differs from size if it was transformed.
+    time_t mtime;       ///< Modification time of the file when it was loaded.
+} FileCacheRecord;
+
+/**
+ * @brief One slot of the file cache index, guarded by a sequence lock and a pin count.
+ *
+ * Writers make seq odd, update the record and make seq even again. Readers copy the
+ * record and retry if seq was odd or changed meanwhile, so lookups never take a lock.
+ * A reader that wants to use the data pins the entry; writers never remove or replace
+ * a pinned entry, so its bytes stay put until the reader unpins it.
+ */
+typedef struct {
+    _Atomic uint32_t seq;        ///< Sequence lock: odd while a writer updates the record.
+    _Atomic uint32_t pins;       ///< Number of requests currently using the entry's data.
+    _Atomic uint8_t referenced;  ///< CLOCK reference bit, set on every hit.
+    _Atomic time_t validated_at; ///< When the entry was last checked against the file system.
+    FileCacheRecord record;      ///< The cached file, valid when seq is even and unchanged.
+} FileCacheEntry;
+
+/**
+ * @brief One shard of the cache: a slot table, its CLOCK hand and its share of the data area.
+ *
+ * Sharding keeps writers for unrelated files off each other's lock.
+ */
+typedef struct {
+    pthread_mutex_t write_lock;                     ///< Process-shared, robust lock serialising writers.
+    size_t clock_hand;                              ///< Next slot the CLOCK sweep looks at (under write_lock).
+    size_t data_start;                              ///< Offset of the shard's part of the data area.
+    size_t data_capacity;                           ///< Size of the shard's part of the data area.
+    FileCacheEntry entries[FILE_CACHE_SHARD_SLOTS]; ///< Open-addressed hash table keyed by path.
+} FileCacheShard;
+
+/**
+ * @brief TinyLFU frequency sketch: a count-min sketch of small saturating counters.
+ *
+ * Every lookup is counted, and every SKETCH_SAMPLE_SIZE lookups all counters are
+ * halved, so the sketch tracks recent popularity of files, cached or not.
+ */
+typedef struct {
+    _Atomic uint8_t counters[SKETCH_DEPTH][SKETCH_WIDTH]; ///< Counters, one row per hash function.
+    _Atomic uint32_t additions;                           ///< Lookups counted since the last halving.
+} FrequencySketch;
+
+/**
+ * @brief Counters describing how well the cache is doing.
+ */
+typedef struct {
+    _Atomic size_t hits;       ///< Lookups answered from memory.
+    _Atomic size_t misses;     ///< Lookups that had to read the file.
+    _Atomic size_t admissions; ///< Files added to the cache.
+    _Atomic size_t rejections; ///< Files the admission filter kept out.
+    _Atomic size_t evictions;  ///< Files evicted to make room.
+} FileCacheStats;
+
+/**
+ * @brief The pins one process holds, counted per entry.
+ *
+ * An entry's pins field is the sum over all processes. Keeping each process's share
+ * separately lets the master take back the pins of a worker that died while sending a
+ * file, which would otherwise keep the entry and its space in the cache for good.
+ */
+typedef struct {
+    _Atomic uint16_t counts[FILE_CACHE_SHARDS * FILE_CACHE_SHARD_SLOTS]; ///< Pins by shard * FILE_CACHE_SHARD_SLOTS + slot.
+} FileCachePins;
+
+/**
+ * @brief Index of the file cache, stored at the start of the shared cache region.
+ */
+typedef struct {
+    FileCacheShard shards[FILE_CACHE_SHARDS];    ///< Shards, selected by the high bits of the path hash.
+    FrequencySketch sketch;                      ///< Access frequencies used for admission.
+    FileCacheStats stats;                        ///< Hit ratio and admission counters.
+    FileCachePins pins[FILE_CACHE_PIN_OWNERS];   ///< Pins by process: [0] the master or single process, [1 + n] worker n.
+} FileCacheIndex;
+
+/**
+ * @brief In-memory cache of static files, shared by every process of the server.
+ *
+ * The index and all file contents live in one MAP_SHARED huge page region that is
+ * created before any worker is forked, so all workers see one copy of the hot content
+ * and a newly spawned worker starts with a warm cache.
+ *
+ * Eviction is CLOCK within each shard, guarded by a TinyLFU admission filter: a new
+ * file only displaces the CLOCK victim if the sketch says it has been requested more
+ * often recently. A crawler touching every file once therefore cannot flush the hot
+ * pages, since files seen once lose against anything requested repeatedly.
+ */
+typedef struct {
+    HugePageRegion region; ///< Memory backing the index and the data area.
+    FileCacheIndex *index; ///< Index at the start of the region (NULL if the cache is disabled).
+    char *data;            ///< Data area following the index.
+    FileCachePins *pins;   ///< Pin counts of this process, in the index.
+} FileCache;
+
+/**
+ * @brief A pinned cache entry, or the contents loaded in its place, handed out by fileCacheAcquire().
+ */
+typedef struct {
+    FileCache *cache;      ///< The cache the entry belongs to.
+    FileCacheEntry *entry; ///< The pinned entry (NULL if nothing is pinned).
+    const char *data;      ///< The cached contents, valid until fileCacheRelease().
+    size_t size;           ///< Size of the contents in bytes.
+    time_t mtime;          ///< Modification time of the file the contents were read from.
+    char *loaded;          ///< Contents read from disk that the cache kept out (freed by fileCacheRelease()).
+} FileCacheHandle;
+
+/**
+ * @brief Global static file cache.
+ */
+FileCache fileCache;
+
+/**
+ * @brief Hash a NUL-terminated string with 64-bit FNV-1a.
+ *
+ * FNV-1a leaves the high bits poorly mixed for strings that differ only near the end,
+ * such as "/img/1.png" and "/img/2.png", so the result goes through the MurmurHash3
+ * finalizer before its high bits are used to pick a shard.
+ */
+uint64_t hashString(const char *str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *str != '\0'; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return (hash != 0 && hash != FILE_CACHE_TOMBSTONE) ? hash : 1;
+}
+
+/**
+ * @brief Select the shard responsible for a path hash.
+ */
+FileCacheShard *fileCacheShard(FileCache *cache, uint64_t hash) {
+    return &cache->index->shards[(hash >> 32) % FILE_CACHE_SHARDS];
+}
+
+/**
+ * @brief Tell whether a record describes a cached file rather than an empty or removed slot.
+ */
+int isLiveRecord(const FileCacheRecord *record) {
+    return record->hash != 0 && record->hash != FILE_CACHE_TOMBSTONE;
+}
+
+/**
+ * @brief Position of a path hash in one row of the frequency sketch.
+ */
+size_t sketchIndex(uint64_t hash, int row) {
+    static const uint64_t seeds[SKETCH_DEPTH] = {
+        0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL,
+    };
+    return ((hash * seeds[row]) >> 32) & (SKETCH_WIDTH - 1);
+}
+
+/**
+ * @brief Count one access to a path in the frequency sketch, halving all counters periodically.
+ */
+void sketchIncrement(FrequencySketch *sketch, uint64_t hash) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        _Atomic uint8_t *counter = &sketch->counters[row][sketchIndex(hash, row)];
+        if (atomic_load_explicit(counter, memory_order_relaxed) < SKETCH_MAX_COUNT) {
+            atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+        }
+    }
+    if (atomic_fetch_add_explicit(&sketch->additions, 1, memory_order_relaxed) + 1 == SKETCH_SAMPLE_SIZE) {
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            for (size_t i = 0; i < SKETCH_WIDTH; i++) {
+                uint8_t count = atomic_load_explicit(&sketch->counters[row][i], memory_order_relaxed);
+                atomic_store_explicit(&sketch->counters[row][i], count >> 1, memory_order_relaxed);
+            }
+        }
+        atomic_store_explicit(&sketch->additions, 0, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Estimate how often a path was accessed recently.
+ */
+unsigned sketchEstimate(FrequencySketch *sketch, uint64_t hash) {
+    unsigned estimate = SKETCH_MAX_COUNT;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned count = atomic_load_explicit(&sketch->counters[row][sketchIndex(hash, row)], memory_order_relaxed);
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/**
+ * @brief Map the shared file cache region and initialise an empty index.
+ *
+ * Must be called before forking workers so they all inherit the same mapping.
+ *
+ * @param size_mb Size of the cache in megabytes; 0 leaves the cache disabled.
+ * @return 0 on success (or when disabled), -1 if the region could not be set up.
+ */
+int initFileCache(FileCache *cache, size_t size_mb) {
+    memset(cache, 0, sizeof(*cache));
+    if (size_mb == 0) {
+        return 0;
+    }
+    if (allocateHugePageRegion(size_mb * 1024 * 1024 + sizeof(FileCacheIndex), 1, &cache->region) == -1) {
+        return -1;
+    }
+    FileCacheIndex *index = (FileCacheIndex *)cache->region.base;
+    memset(index, 0, sizeof(FileCacheIndex));
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    size_t shard_capacity = (cache->region.size - sizeof(FileCacheIndex)) / FILE_CACHE_SHARDS;
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        int result = pthread_mutex_init(&index->shards[i].write_lock, &attributes);
+        if (result != 0) {
+            fprintf(stderr, "Failed to initialise file cache lock: %s\n", strerror(result));
+            pthread_mutexattr_destroy(&attributes);
+            munmap(cache->region.base, cache->region.size);
+            memset(cache, 0, sizeof(*cache));
+            return -1;
+        }
+        index->shards[i].data_start = i * shard_capacity;
+        index->shards[i].data_capacity = shard_capacity;
+    }
+    pthread_mutexattr_destroy(&attributes);
+
+    cache->data = cache->region.base + sizeof(FileCacheIndex);
+    cache->index = index;
+    cache->pins = &index->pins[0];
+    return 0;
+}
+
+/**
+ * @brief Count this process's pins in the table of a worker slot. Called in a new worker.
+ *
+ * @param worker The worker index.
+ */
+void useWorkerFileCachePins(FileCache *cache, int worker) {
+    if (cache->index != NULL) {
+        cache->pins = &cache->index->pins[1 + worker];
+    }
+}
+
+/**
+ * @brief Take back the pins held by a worker that has died, so its entries can be evicted again.
+ *
+ * Called by the master after reaping the worker and before starting its replacement.
+ * Pins are counted in the table after they are taken and before they are dropped, so
+ * a worker killed between the two steps leaks one pin rather than losing one that
+ * another process still holds.
+ *
+ * @param worker The worker index.
+ * @return The number of pins taken back.
+ */
+size_t dropWorkerFileCachePins(FileCache *cache, int worker) {
+    if (cache->index == NULL) {
+        return 0;
+    }
+    FileCachePins *pins = &cache->index->pins[1 + worker];
+    size_t dropped = 0;
+    for (size_t i = 0; i < FILE_CACHE_SHARDS * FILE_CACHE_SHARD_SLOTS; i++) {
+        uint16_t count = atomic_exchange(&pins->counts[i], 0);
+        if (count != 0) {
+            FileCacheEntry *entry = &cache->index->shards[i / FILE_CACHE_SHARD_SLOTS].entries[i % FILE_CACHE_SHARD_SLOTS];
+            atomic_fetch_sub(&entry->pins, count);
+            dropped += count;
+        }
+    }
+    return dropped;
+}
+
+/**
+ * @brief Take a shard's write lock, repairing the shard if the previous owner died.
+ *
+ * A worker that crashed in the middle of an update leaves its entry with an odd
+ * sequence number and possibly half-written fields. Unless readers still pin it (in
+ * which case the writer had not touched it yet), such an entry becomes a tombstone.
+ */
+void lockFileCacheShard(FileCacheShard *shard) {
+    if (pthread_mutex_lock(&shard->write_lock) == EOWNERDEAD) {
+        for (size_t i = 0; i < FILE_CACHE_SHARD_SLOTS; i++) {
+            FileCacheEntry *entry = &shard->entries[i];
+            uint32_t seq = atomic_load(&entry->seq);
+            if (seq & 1) {
+                if (atomic_load(&entry->pins) == 0) {
+                    entry->record.hash = FILE_CACHE_TOMBSTONE;
+                }
+                atomic_store(&entry->seq, seq + 1);
+            }
+        }
+        pthread_mutex_consistent(&shard->write_lock);
+    }
+}
+
+/**
+ * @brief Release a shard's write lock.
+ */
+void unlockFileCacheShard(FileCacheShard *shard) {
+    pthread_mutex_unlock(&shard->write_lock);
+}
+
+/**
+ * @brief Take a consistent snapshot of an entry's record without locking.
+ *
+ * @param seq Receives the sequence number the snapshot is valid for (may be NULL).
+ * @return 0 on success, -1 if a writer kept the entry busy for too long.
+ */
+int readFileCacheEntry(FileCacheEntry *entry, FileCacheRecord *record, uint32_t *seq) {
+    for (int attempt = 0; attempt < FILE_CACHE_READ_RETRIES; attempt++) {
+        uint32_t before = atomic_load_explicit(&entry->seq, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(record, &entry->record, sizeof(*record));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&entry->seq, memory_order_relaxed) == before) {
+            if (seq != NULL) {
+                *seq = before;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Find this process's pin count for an entry.
+ */
+_Atomic uint16_t *fileCachePinCount(FileCache *cache, FileCacheEntry *entry) {
+    size_t shard = ((char *)entry - (char *)cache->index->shards) / sizeof(FileCacheShard);
+    size_t slot = entry - cache->index->shards[shard].entries;
+    return &cache->pins->counts[shard * FILE_CACHE_SHARD_SLOTS + slot];
+}
+
+/**
+ * @brief Pin an entry whose record was read at sequence number seq.
+ *
+ * Pairs with retireFileCacheEntry(): either the writer sees the pin and leaves the
+ * entry alone, or the reader sees the sequence number move and backs off.
+ *
+ * @return 0 if the entry is pinned and still holds the record, -1 if it changed.
+ */
+int pinFileCacheEntry(FileCache *cache, FileCacheEntry *entry, uint32_t seq) {
+    atomic_fetch_add(&entry->pins, 1);
+    if (atomic_load(&entry->seq) == seq) {
+        atomic_fetch_add(fileCachePinCount(cache, entry), 1);
+        return 0;
+    }
+    atomic_fetch_sub(&entry->pins, 1);
+    return -1;
+}
+
+/**
+ * @brief Drop a pin taken with pinFileCacheEntry().
+ */
+void unpinFileCacheEntry(FileCache *cache, FileCacheEntry *entry) {
+    atomic_fetch_sub(fileCachePinCount(cache, entry), 1);
+    atomic_fetch_sub(&entry->pins, 1);
+}
+
+/**
+ * @brief Turn an unpinned entry into a tombstone, releasing its space. Requires the shard lock.
+ *
+ * @return 0 if the entry was removed, -1 if readers still pin it.
+ */
+int retireFileCacheEntry(FileCacheEntry *entry) {
+    atomic_fetch_add(&entry->seq, 1);
+    if (atomic_load(&entry->pins) != 0) {
+        atomic_fetch_add(&entry->seq, 1);
+        return -1;
+    }
+    entry->record.hash = FILE_CACHE_TOMBSTONE;
+    atomic_fetch_add(&entry->seq, 1);
+    return 0;
+}
+
+/**
+ * @brief Find the live entry holding a path without taking any lock.
+ *
+ * @param record Receives a snapshot of the entry's record.
+ * @param seq Receives the sequence number of the snapshot.
+ * @return The entry, or NULL if the path is not cached.
+ */
+FileCacheEntry *findFileCacheEntry(FileCache *cache, FileCacheShard *shard, uint64_t hash,
+                                   const char *path, FileCacheRecord *record, uint32_t *seq) {
+    for (size_t probe = 0; probe < FILE_CACHE_SHARD_SLOTS; probe++) {
+        FileCacheEntry *entry = &shard->entries[(hash + probe) % FILE_CACHE_SHARD_SLOTS];
+        if (readFileCacheEntry(entry, record, seq) == -1) {
+            return NULL;
+        }
+        if (record->hash == 0) {
+            return NULL;
+        }
+        // A key changing under us is caught when the entry is pinned
+        if (record->hash == hash && strcmp(cache->data + record->key_offset, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Comparator ordering data extents by offset.
+ */
+int compareExtents(const void *a, const void *b) {
+    const size_t *left = a;
+    const size_t *right = b;
+    return (left[0] > right[0]) - (left[0] < right[0]);
+}
+
+/**
+ * @brief Find a free gap in a shard's data area. Requires the shard lock.
+ *
+ * The live entries are the only record of which bytes are in use, so the free space is
+ * simply the gaps between their extents. A shard has few entries and this only runs
+ * when a file is added, so sorting them each time is cheap.
+ *
+ * @param needed The number of bytes wanted.
+ * @return The offset of a large enough gap, or SIZE_MAX if there is none.
+ */
+size_t findFreeExtent(FileCacheShard *shard, size_t needed) {
+    size_t extents[FILE_CACHE_SHARD_SLOTS][2];
+    size_t count = 0;
+    for (size_t i = 0; i < FILE_CACHE_SHARD_SLOTS; i++) {
+        const FileCacheRecord *record = &shard->entries[i].record;
+        if (isLiveRecord(record)) {
+            extents[count][0] = record->key_offset;
+            extents[count][1] = record->data_offset + record->size;
+            count++;
+        }
+    }
+    qsort(extents, count, sizeof(extents[0]), compareExtents);
+
+    size_t offset = shard->data_start;
+    for (size_t i = 0; i <= count; i++) {
+        size_t gap_end = i < count ? extents[i][0] : shard->data_start + shard->data_capacity;
+        if (gap_end - offset >= needed) {
+            return offset;
+        }
+        if (i < count && extents[i][1] > offset) {
+            offset = extents[i][1];
+        }
+    }
+    return SIZE_MAX;
+}
+
+/**
+ * @brief Advance the CLOCK hand to the next unreferenced, unpinned entry. Requires the shard lock.
+ *
+ * @return The victim, or NULL if every entry is pinned or the shard is empty.
+ */
+FileCacheEntry *selectClockVictim(FileCacheShard *shard) {
+    for (size_t step = 0; step < 2 * FILE_CACHE_SHARD_SLOTS; step++) {
+        FileCacheEntry *entry = &shard->entries[shard->clock_hand];
+        shard->clock_hand = (shard->clock_hand + 1) % FILE_CACHE_SHARD_SLOTS;
+        if (!isLiveRecord(&entry->record) || atomic_load(&entry->pins) != 0) {
+            continue;
+        }
+        if (atomic_exchange_explicit(&entry->referenced, 0, memory_order_relaxed)) {
+            continue; // Second chance
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Add a file's contents to the cache, evicting colder files if the admission filter agrees.
+ *
+ * An older copy of the same file is replaced unless it is still pinned. When the
+ * shard has no free slot or not enough free space, CLOCK victims are evicted as long
+ * as the new file is more popular than each of them according to the sketch.
+ *
+ * @param file_size Size of the file on disk, used to notice changes.
+ * @param handle If not NULL, receives the new entry pinned for the caller.
+ * @return 0 if the file was cached, -1 if it was rejected or there is no room.
+ */
+int fileCacheInsert(FileCache *cache, uint64_t hash, const char *path, const char *contents,
+                    size_t size, size_t file_size, time_t mtime, time_t now, FileCacheHandle *handle) {
+    FileCacheShard *shard = fileCacheShard(cache, hash);
+    FileCacheStats *stats = &cache->index->stats;
+    size_t key_length = strlen(path) + 1;
+    size_t needed = key_length + size;
+    if (needed > shard->data_capacity) {
+        return -1;
+    }
+
+    lockFileCacheShard(shard);
+    FileCacheEntry *slot = NULL;
+    for (size_t probe = 0; probe < FILE_CACHE_SHARD_SLOTS; probe++) {
+        FileCacheEntry *entry = &shard->entries[(hash + probe) % FILE_CACHE_SHARD_SLOTS];
+        if (entry->record.hash == 0) {
+            if (slot == NULL) {
+                slot = entry;
+            }
+            break;
+        }
+        if (entry->record.hash == FILE_CACHE_TOMBSTONE) {
+            if (slot == NULL) {
+                slot = entry;
+            }
+        } else if (entry->record.hash == hash && strcmp(cache->data + entry->record.key_offset, path) == 0) {
+            // Replace the older copy, unless a request is still sending it
+            if (retireFileCacheEntry(entry) == -1) {
+                unlockFileCacheShard(shard);
+                return -1;
+            }
+            slot = entry;
+            break;
+        }
+    }
+
+    size_t offset = slot != NULL ? findFreeExtent(shard, needed) : SIZE_MAX;
+    unsigned frequency = sketchEstimate(&cache->index->sketch, hash);
+    while (slot == NULL || offset == SIZE_MAX) {
+        FileCacheEntry *victim = selectClockVictim(shard);
+        if (victim == NULL || frequency <= sketchEstimate(&cache->index->sketch, victim->record.hash)) {
+            atomic_fetch_add_explicit(&stats->rejections, 1, memory_order_relaxed);
+            unlockFileCacheShard(shard);
+            return -1;
+        }
+        if (retireFileCacheEntry(victim) == -1) {
+            continue;
+        }
+        atomic_fetch_add_explicit(&stats->evictions, 1, memory_order_relaxed);
+        if (slot == NULL) {
+            slot = victim;
+        }
+        offset = findFreeExtent(shard, needed);
+    }
+
+    // The bytes in the gap are not reachable by readers until the record points at them
+    memcpy(cache->data + offset, path, key_length);
+    memcpy(cache->data + offset + key_length, contents, size);
+    FileCacheRecord record = {hash, offset, offset + key_length, size, file_size, mtime};
+
+    atomic_fetch_add(&slot->seq, 1);
+    memcpy(&slot->record, &record, sizeof(record));
+    atomic_store_explicit(&slot->referenced, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->validated_at, now, memory_order_relaxed);
+    if (handle != NULL) {
+        atomic_fetch_add(&slot->pins, 1);
+        atomic_fetch_add(fileCachePinCount(cache, slot), 1);
+        handle->cache = cache;
+        handle->entry = slot;
+        handle->data = cache->data + record.data_offset;
+        handle->size = size;
+        handle->mtime = mtime;
+    }
+    atomic_fetch_add(&slot->seq, 1);
+    atomic_fetch_add_explicit(&stats->admissions, 1, memory_order_relaxed);
+    unlockFileCacheShard(shard);
+    return 0;
+}
+
+/**
+ * @brief Look up a file in the cache, loading it from disk on a miss.
+ *
+ * Cached entries are re-checked against the file's mtime and size at most once every
+ * FILE_CACHE_REVALIDATE_SECONDS, so edits show up without a stat() on every request.
+ * Unless -1 is returned the handle must be handed back with fileCacheRelease().
+ *
+ * A miss the cache cannot take (admission rejected, or an older copy still pinned) still
+ * hands out the contents it loaded, so a one-hit request reads and transforms the file
+ * only once.
+ *
+ * @param path The file path (as used in the route table).
+ * @param handle Receives the pinned entry, or the loaded contents, with their size.
+ * @return 0 if the contents are cached, 1 if they were loaded but not cached, -1 if
+ *         nothing was loaded (cache disabled, file missing or too large). Callers fall
+ *         back to ReadFile() on -1.
+ */
+int fileCacheAcquire(FileCache *cache, const char *path, FileCacheHandle *handle) {
+    memset(handle, 0, sizeof(*handle));
+    if (cache->index == NULL) {
+        return -1;
+    }
+
+    uint64_t hash = hashString(path);
+    FileCacheShard *shard = fileCacheShard(cache, hash);
+    FileCacheStats *stats = &cache->index->stats;
+    sketchIncrement(&cache->index->sketch, hash);
+    time_t now = time(NULL);
+    struct stat file_stat;
+
+    for (int attempt = 0; attempt < FILE_CACHE_READ_RETRIES; attempt++) {
+        FileCacheRecord record;
+        uint32_t seq;
+        FileCacheEntry *entry = findFileCacheEntry(cache, shard, hash, path, &record, &seq);
+        if (entry == NULL) {
+            break;
+        }
+        if (pinFileCacheEntry(cache, entry, seq) == -1) {
+            continue; // Replaced while we looked; look again
+        }
+
+        time_t validated_at = atomic_load_explicit(&entry->validated_at, memory_order_relaxed);
+        int fresh = now - validated_at < FILE_CACHE_REVALIDATE_SECONDS;
+        if (!fresh && stat(path, &file_stat) == 0 && file_stat.st_mtime == record.mtime &&
+            (size_t)file_stat.st_size == record.file_size) {
+            atomic_store_explicit(&entry->validated_at, now, memory_order_relaxed);
+            fresh = 1;
+        }
+        if (!fresh) {
+            unpinFileCacheEntry(cache, entry);
+            break;
+        }
+        atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->hits, 1, memory_order_relaxed);
+        handle->cache = cache;
+        handle->entry = entry;
+        handle->data = cache->data + record.data_offset;
+        handle->size = record.size;
+        handle->mtime = record.mtime;
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&stats->misses, 1, memory_order_relaxed);
+    if (stat(path, &file_stat) == -1 || (size_t)file_stat.st_size >= shard->data_capacity) {
+        return -1;
+    }
+
+    // Read the file before taking the lock so other processes never wait on disk I/O
+    long size;
+    char *contents = loadAssetFile(path, &size);
+    if (contents == NULL) {
+        return -1;
+    }
+    if (fileCacheInsert(cache, hash, path, contents, size, file_stat.st_size, file_stat.st_mtime, now, handle) == 0) {
+        free(contents);
+        return 0;
+    }
+    handle->loaded = contents;
+    handle->data = contents;
+    handle->size = size;
+    handle->mtime = file_stat.st_mtime;
+    return 1;
+}
+
+/**
+ * @brief Look up the size and mtime of a cached file without touching its contents.
+ *
+ * Used for HEAD requests: the record is copied under the entry's sequence lock, the
+ * entry is not pinned, and the lookup is not counted by the admission filter, so
+ * monitoring probes neither hold cache space nor make files look popular.
+ *
+ * @param path The file path (as used in the route table).
+ * @param size Receives the size of the file.
+ * @param mtime Receives the modification time of the file.
+ * @return 0 if the cache holds a fresh record for path, -1 otherwise.
+ */
+int fileCachePeek(FileCache *cache, const char *path, size_t *size, time_t *mtime) {
+    if (cache->index == NULL) {
+        return -1;
+    }
+    uint64_t hash = hashString(path);
+    FileCacheRecord record;
+    uint32_t seq;
+    FileCacheEntry *entry = findFileCacheEntry(cache, fileCacheShard(cache, hash), hash, path, &record, &seq);
+    // Without a pin the key comparison may have raced a writer; the sequence number tells
+    if (entry == NULL || atomic_load(&entry->seq) != seq) {
+        return -1;
+    }
+    time_t validated_at = atomic_load_explicit(&entry->validated_at, memory_order_relaxed);
+    if (time(NULL) - validated_at >= FILE_CACHE_REVALIDATE_SECONDS) {
+        return -1; // Let the caller stat() the file instead
+    }
+    atomic_fetch_add_explicit(&cache->index->stats.hits, 1, memory_order_relaxed);
+    *size = record.size;
+    *mtime = record.mtime;
+    return 0;
+}
+
+/**
+ * @brief Unpin or free what fileCacheAcquire() handed out. Safe to call on an empty handle.
+ */
+void fileCacheRelease(FileCacheHandle *handle) {
+    if (handle->entry != NULL) {
+        unpinFileCacheEntry(handle->cache, handle->entry);
+        handle->entry = NULL;
+    }
+    free(handle->loaded);
+    handle->loaded = NULL;
+}
+
+/**
+ * @brief Print the cache's hit ratio and admission counters.
+ */
+void printFileCacheStats(FileCache *cache) {
+    if (cache->index == NULL) {
+        return;
+    }
+    FileCacheStats *stats = &cache->index->stats;
+    size_t hits = atomic_load(&stats->hits);
+    size_t misses = atomic_load(&stats->misses);
+    printf("File cache: %zu hits, %zu misses (hit ratio %.1f%%), %zu admitted, %zu rejected, %zu evicted\n",
+           hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+           atomic_load(&stats->admissions), atomic_load(&stats->rejections), atomic_load(&stats->evictions));
+}
+
+//------------------------------------------------------------------
+#define SNAPSHOT_MAGIC "HTTPCSNP"
+#define SNAPSHOT_VERSION 2
+
+/**
+ * @brief Header at the start of a cache snapshot file.
+ */
+typedef struct {
+    char magic[8];        ///< SNAPSHOT_MAGIC, not NUL-terminated.
+    uint32_t version;     ///< SNAPSHOT_VERSION.
+    uint32_t entry_count; ///< Number of SnapshotEntry records that follow.
+} SnapshotHeader;
+
+/**
+ * @brief Record preceding each cached file in a snapshot.
+ *
+ * It is followed by the NUL-terminated path (path_length bytes including the NUL), the
+ * file contents (size bytes) and padding up to the next multiple of 8 bytes.
+ */
+typedef struct {
+    uint32_t path_length; ///< Length of the path including its NUL terminator.
+    uint32_t reserved;    ///< Always 0.
+    int64_t mtime;        ///< Modification time the contents were loaded with.
+    uint64_t size;        ///< Size of the contents in bytes.
+    uint64_t file_size;   ///< Size of the file on disk when the contents were loaded.
+} SnapshotEntry;
+
+/**
+ * @brief Round a snapshot record length up to the 8 byte record alignment.
+ */
+size_t snapshotAlign(size_t length) {
+    return (length + 7) & ~(size_t)7;
+}
+
+/**
+ * @brief Write every file in the cache to a snapshot file.
+ *
+ * The snapshot is written to "<path>.tmp" and renamed into place, so a crash while
+ * saving never leaves a truncated snapshot behind.
+ *
+ * @param cache The cache to save.
+ * @param path The snapshot file.
+ * @return The number of files saved, or -1 on error.
+ */
+int saveCacheSnapshot(FileCache *cache, const char *path) {
+    if (cache->index == NULL) {
+        return 0;
+    }
+
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+        fprintf(stderr, "Snapshot path too long: %s\n", path);
+        return -1;
+    }
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error creating snapshot %s: %s\n", temp_path, strerror(errno));
+        return -1;
+    }
+
+    // The entry count is patched in once all entries are written
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    static const char padding[8] = {0};
+    for (size_t i = 0; ok && i < FILE_CACHE_SHARDS * FILE_CACHE_SHARD_SLOTS; i++) {
+        FileCacheEntry *cache_entry = &cache->index->shards[i / FILE_CACHE_SHARD_SLOTS].entries[i % FILE_CACHE_SHARD_SLOTS];
+        FileCacheRecord record;
+        uint32_t seq;
+        // Pin the entry so it cannot be evicted while it is being written out
+        if (readFileCacheEntry(cache_entry, &record, &seq) == -1 || !isLiveRecord(&record) ||
+            pinFileCacheEntry(cache, cache_entry, seq) == -1) {
+            continue;
+        }
+        const char *file_path = cache->data + record.key_offset;
+        SnapshotEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.path_length = strlen(file_path) + 1;
+        entry.mtime = record.mtime;
+        entry.size = record.size;
+        entry.file_size = record.file_size;
+        size_t length = entry.path_length + entry.size;
+
+        ok = fwrite(&entry, sizeof(entry), 1, file) == 1 &&
+             fwrite(file_path, 1, entry.path_length, file) == entry.path_length &&
+             fwrite(cache->data + record.data_offset, 1, record.size, file) == record.size &&
+             fwrite(padding, 1, snapshotAlign(length) - length, file) == snapshotAlign(length) - length;
+        unpinFileCacheEntry(cache, cache_entry);
+        header.entry_count++;
+    }
+
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0 || !ok || rename(temp_path, path) == -1) {
+        fprintf(stderr, "Error writing snapshot %s: %s\n", path, strerror(errno));
+        unlink(temp_path);
+        return -1;
+    }
+    return header.entry_count;
+}
+
+/**
+ * @brief Warm the cache from a snapshot file written by saveCacheSnapshot().
+ *
+ * The snapshot is mmapped and each entry is checked against the file it came from:
+ * only files whose mtime and size still match are loaded, so a deploy that changed a
+ * file never serves the old contents. A missing, foreign or damaged snapshot is
+ * ignored and the server simply starts cold.
+ *
+ * @param cache The cache to fill; it should be freshly initialised.
+ * @param path The snapshot file.
+ * @return The number of files restored, or -1 if the snapshot could not be used.
+ */
+int loadCacheSnapshot(FileCache *cache, const char *path) {
+    if (cache->index == NULL) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Error opening snapshot %s: %s\n", path, strerror(errno));
+        }
+        return -1;
+    }
+    struct stat snapshot_stat;
+    if (fstat(fd, &snapshot_stat) == -1 || (size_t)snapshot_stat.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t length = snapshot_stat.st_size;
+    const char *snapshot = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snapshot == MAP_FAILED) {
+        fprintf(stderr, "Error mapping snapshot %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    SnapshotHeader header;
+    memcpy(&header, snapshot, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "Ignoring snapshot %s: unknown format\n", path);
+        munmap((void *)snapshot, length);
+        return -1;
+    }
+
+    int restored = 0;
+    time_t now = time(NULL);
+    size_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.entry_count; i++) {
+        SnapshotEntry entry;
+        if (length - offset < sizeof(entry)) {
+            break;
+        }
+        memcpy(&entry, snapshot + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (entry.path_length == 0 || entry.path_length > length - offset ||
+            entry.size > length - offset - entry.path_length) {
+            break;
+        }
+        const char *file_path = snapshot + offset;
+        const char *contents = file_path + entry.path_length;
+        offset += snapshotAlign(entry.path_length + entry.size);
+        if (file_path[entry.path_length - 1] != '\0' || offset > length) {
+            break;
+        }
+
+        struct stat file_stat;
+        if (stat(file_path, &file_stat) == -1 || file_stat.st_mtime != entry.mtime ||
+            (uint64_t)file_stat.st_size != entry.file_size) {
+            continue; // Changed or gone since the snapshot was taken
+        }
+        if (fileCacheInsert(cache, hashString(file_path), file_path, contents,
+                            entry.size, entry.file_size, entry.mtime, now, NULL) == 0) {
+            restored++;
+        }
+    }
+
+    munmap((void *)snapshot, length);
+    printf("Restored %d of %u cached files from %s\n", restored, header.entry_count, path);
+    return restored;
+}
+
+//------------------------------------------------------------------
+
+/**
+ * @brief A bump allocator over the part of the connection buffer not used for receiving.
+ *
+ * Everything a request needs besides the received bytes (the header table, for
+ * example) is carved out of it, and it is simply discarded with the buffer, so parsing
+ * a request never calls malloc.
+ */
+typedef struct {
+    char *next; ///< Next free byte.
+    char *end;  ///< One past the last usable byte.
+} RequestArena;
+
+/**
+ * @brief Allocate size bytes, aligned to 8 bytes, from a request arena.
+ *
+ * @return The memory, or NULL if the arena is exhausted.
+ */
+void *arenaAllocate(RequestArena *arena, size_t size) {
+    uintptr_t aligned = ((uintptr_t)arena->next + 7) & ~(uintptr_t)7;
+    if (aligned > (uintptr_t)arena->end || size > (uintptr_t)arena->end - aligned) {
+        return NULL;
+    }
+    arena->next = (char *)(aligned + size);
+    return (void *)aligned;
+}
+
+/**
+ * @brief A request header. Both strings point into the connection buffer.
+ */
+typedef struct {
+    const char *name;  ///< Header name, NUL-terminated in place.
+    const char *value; ///< Header value without surrounding whitespace, NUL-terminated in place.
+} HttpHeader;
+
+/**
+ * @brief A name/value pair from the query string or the Cookie header.
+ */
+typedef struct {
+    const char *name;  ///< Parameter name, NUL-terminated in the request arena.
+    const char *value; ///< Parameter value ("" if the pair had no '='), NUL-terminated in the request arena.
+} HttpParameter;
+
+typedef struct ListenerPolicy ListenerPolicy;
+
+/**
+ * @brief Structure representing an HTTP request.
+ *
+ * This structure stores information about an HTTP request, including the HTTP method,
+ * the request path, the headers and, if applicable, the request body. All strings are
+ * slices of the connection buffer that were NUL-terminated in place while parsing, so
+ * the structure is small and its size does not depend on the length of the URL.
+ */
+typedef struct {
+    const char *method;    ///< The HTTP method (e.g., "GET").
+    const char *target;    ///< The request target exactly as received (e.g., "/a/../index.html?x=1").
+    const char *path;      ///< The normalized request path (e.g., "/index.html").
+    size_t path_length;    ///< Length of the normalized request path in bytes.
+    const char *query;     ///< The raw query string after '?' (NULL if the target has none).
+    const char *version;   ///< The protocol version (e.g., "HTTP/1.1").
+    const ListenerPolicy *policy; ///< Routes and limits of the listener the request arrived on.
+    HttpHeader *headers;   ///< The request headers, allocated from the request arena.
+    size_t header_count;   ///< Number of entries in headers.
+    size_t content_length; ///< Value of the Content-Length header (0 if not present).
+    char *body;            ///< Pointer to the received part of the request body (may be NULL if not present).
+    size_t body_size;      ///< Number of body bytes received so far (0 if not present).
+    unsigned char body_allocated; ///< Whether body was allocated with malloc and must be freed.
+    RequestArena *arena;   ///< Arena for data parsed on demand (query parameters, cookies).
+    HttpParameter *query_parameters; ///< Query parameters, parsed by the first getQueryParameter().
+    size_t query_parameter_count;    ///< Number of entries in query_parameters.
+    HttpParameter *cookies;          ///< Cookies, parsed by the first getCookie().
+    size_t cookie_count;             ///< Number of entries in cookies.
+    unsigned char query_parsed;      ///< Whether query_parameters has been filled in.
+    unsigned char cookies_parsed;    ///< Whether cookies has been filled in.
+} HttpRequest;
+
+/**
+ * @brief Structure representing an HTTP response.
+ *
+ * This structure stores information about an HTTP response, including the HTTP status code,
+ * status message, content length, and the response content.
+ */
+typedef struct {
+    int status_code;            ///< The HTTP status code (e.g., 200, 404).
+    char status_message[MAX_STATUS_MESSAGE_SIZE];    ///< The HTTP status message (e.g., "OK", "Not Found").
+    size_t content_length;      ///< The length of the response content.
+    const char *content;        ///< Pointer to the response content (not owned by the response).
+    const char *content_type;   ///< Media type of the content (NULL = text/html).
+    char etag[MAX_ETAG_SIZE];   ///< Entity tag including quotes ("" = no ETag header).
+    const char *cache_headers;  ///< Prebuilt Cache-Control and Expires lines (NULL = none).
+    unsigned char omit_body;    ///< Send only the header block, as for a HEAD request.
+    unsigned char length_unknown; ///< Leave out Content-Length (a HEAD answered before the size is known).
+} HttpResponse;
+
+/**
+ * @brief How long clients and proxies may reuse a response without asking again.
+ *
+ * The Cache-Control and Expires lines of a policy are serialized once per second and
+ * reused by every response sent in that second, instead of being formatted per request.
+ */
+typedef struct {
+    const char *cache_control;     ///< Cache-Control directives.
+    int max_age;                   ///< Seconds from now for the Expires header.
+    time_t header_time;            ///< Second the prebuilt header lines were made for.
+    char header[MAX_CACHE_HEADER_SIZE]; ///< Prebuilt "Cache-Control: ...\r\nExpires: ...\r\n".
+} CachePolicy;
+
+/**
+ * @brief Pages and anything that may change under the same URL: always revalidate.
+ */
+CachePolicy revalidateCachePolicy = {"no-cache", 0, 0, ""};
+
+/**
+ * @brief Unversioned assets: reuse for an hour, then revalidate.
+ */
+CachePolicy assetCachePolicy = {"public, max-age=3600", 3600, 0, ""};
+
+/**
+ * @brief Fingerprinted assets: the URL changes whenever the content does.
+ */
+CachePolicy immutableCachePolicy = {"public, max-age=31536000, immutable", 31536000, 0, ""};
+
+/**
+ * @brief Structure representing a route mapping for an HTTP server.
+ *
+ * This structure is used to map URL paths to corresponding resources or files.
+ * It also allows for associating optional callback functions to handle requests
+ * for specific routes.
+ */
+typedef struct {
+    const char *path;              ///< The URL path to match.
+    const char *link;              ///< The corresponding file or resource path.
+    int (*callback)(int client_socket, HttpRequest *request, size_t *content_length); ///< Optional callback that answers requests for this route itself (GET and HEAD; for HEAD it sends no body); returns the status code sent.
+    size_t max_body_size;          ///< Largest request body accepted (0 = the listener policy's limit).
+    int (*accept_body)(HttpRequest *request); ///< Optional check run on the headers before any body byte is read; returns 0 or the status code to reject with.
+    CachePolicy *cache_policy;     ///< Caching policy for the route (NULL = chosen by file name).
+} RouteMapping;
+
+
+/**
+ * @brief Global array of GET method route mappings for the HTTP server.
+ *
+ * This array defines the routes and associated resources for handling HTTP GET requests.
+ * Each element in the array represents a route mapping, consisting of a URL path,
+ * a corresponding file path, and an optional callback function.
+ */
+RouteMapping getRouteMappings[] = {
+    {"/", "./public_html/index.html", NULL, 0, NULL, NULL},
+    {"/test", "./public_html/test.html", NULL, 0, NULL, NULL},
+    // Add more route mappings as needed
+};
+
+int handleEchoRequest(int client_socket, HttpRequest *request, size_t *content_length);
+
+/**
+ * @brief Global array of POST method route mappings for the HTTP server.
+ *
+ * POST routes are answered by their callback once the request body has been received.
+ * Their body limit and optional accept_body check are applied to the headers first, so
+ * an upload that would be refused is refused before the client sends any of it.
+ */
+RouteMapping postRouteMappings[] = {
+    {"/echo", NULL, handleEchoRequest, 0, NULL, NULL},
+    // Add more route mappings as needed
+};
+
+int handleMetricsRequest(int client_socket, HttpRequest *request, size_t *content_length);
+int handleListenersRequest(int client_socket, HttpRequest *request, size_t *content_length);
+int handleConnectionsRequest(int client_socket, HttpRequest *request, size_t *content_length);
+
+/**
+ * @brief GET routes of the admin listener: operational endpoints that stay off the public port.
+ */
+RouteMapping adminRouteMappings[] = {
+    {"/metrics", NULL, handleMetricsRequest, 0, NULL, NULL},
+    {"/debug/listeners", NULL, handleListenersRequest, 0, NULL, NULL},
+    {"/debug/connections", NULL, handleConnectionsRequest, 0, NULL, NULL},
+};
+
+/**
+ * @brief Which requests a listener writes to the access log.
+ */
+typedef enum {
+    ACCESS_LOG_NONE,   ///< Nothing.
+    ACCESS_LOG_ERRORS, ///< Requests answered with an error status, or not answered at all.
+    ACCESS_LOG_ALL,    ///< Every request.
+} AccessLogLevel;
+
+/**
+ * @brief What a listener serves and how strictly: its routes, request limits and logging.
+ *
+ * Every worker accepts on every listener, so a public port and an internal admin port
+ * share one set of event loops but answer with different route tables.
+ */
+struct ListenerPolicy {
+    const char *name;                ///< Name used to pick the policy in --listen=<address>@<name>.
+    const RouteMapping *get_routes;  ///< Routes for GET and HEAD.
+    size_t get_route_count;          ///< Number of entries in get_routes.
+    const RouteMapping *post_routes; ///< Routes for POST.
+    size_t post_route_count;         ///< Number of entries in post_routes.
+    int serve_static_files;          ///< Fall back to templates and the site archive for unrouted paths.
+    int max_uri_length;              ///< Longest request path accepted; longer ones get 414.
+    int max_header_size;             ///< Largest request header block accepted; larger ones get 431.
+    int max_headers;                 ///< Most request headers accepted; more get 431.
+    int max_body_size;               ///< Largest body accepted by routes without their own limit.
+    AccessLogLevel log_level;        ///< Which requests are written to the access log.
+};
+
+/**
+ * @brief The policy of the positional listener and of --listen addresses without "@<name>".
+ *
+ * Its limits are copied from the command line options at startup.
+ */
+ListenerPolicy publicPolicy = {
+    "public",
+    getRouteMappings, sizeof(getRouteMappings) / sizeof(RouteMapping),
+    postRouteMappings, sizeof(postRouteMappings) / sizeof(RouteMapping),
+    1, 0, 0, 0, 0, ACCESS_LOG_ALL,
+};
+
+/**
+ * @brief The policy of admin listeners: metrics and debug endpoints, tight limits, errors logged only.
+ */
+ListenerPolicy adminPolicy = {
+    "admin",
+    adminRouteMappings, sizeof(adminRouteMappings) / sizeof(RouteMapping),
+    NULL, 0,
+    0, 256, 4096, 32, 0, ACCESS_LOG_ERRORS,
+};
+
+/**
+ * @brief Policies that --listen can name.
+ */
+ListenerPolicy *listenerPolicies[] = {&publicPolicy, &adminPolicy};
+
+/**
+ * @brief A socket the server accepts connections on.
+ */
+typedef struct {
+    const char *spec;                ///< The address as given: "ip:port", "[ipv6]:port" or "unix:/path".
+    struct sockaddr_storage address; ///< The parsed address.
+    socklen_t address_length;        ///< Length of address.
+    const ListenerPolicy *policy;    ///< Routes, limits and logging of connections accepted here.
+    int fd;                          ///< The listening socket (-1 until opened).
+} Listener;
+
+/**
+ * @brief The listeners of this server; every worker accepts on all of them.
+ */
+Listener listeners[MAX_LISTENERS];
+int listenerCount = 0;
+
+/**
+ * @brief Find a request header by name (case-insensitively).
+ *
+ * @param request The parsed request.
+ * @param name The header name, e.g. "Content-Length".
+ * @return The header value, or NULL if the request does not carry the header.
+ */
+const char *getHeader(const HttpRequest *request, const char *name) {
+    for (size_t i = 0; i < request->header_count; i++) {
+        if (strcasecmp(request->headers[i].name, name) == 0) {
+            return request->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Tell whether a request is a HEAD request, whose response carries headers only.
+ */
+int isHeadRequest(const HttpRequest *request) {
+    return strcmp(request->method, "HEAD") == 0;
+}
+
+/**
+ * @brief Tell whether a request target needs the slow path of normalizeRequestPath().
+ *
+ * A target needs work if it contains a query ('?'), a percent escape ('%'), an empty
+ * or dot segment ("//", "/.") or a trailing slash. Most targets contain none of these,
+ * and with SSE2 they are ruled out 16 bytes per step: one load compares every byte
+ * against '%' and '?', and a second load shifted by one byte lines up each '/' with
+ * the byte after it.
+ *
+ * @param target The request target; target[length] must be readable (it is the NUL).
+ * @param length Length of the target in bytes.
+ * @return 1 if the target must be normalized, 0 if it can be used as is.
+ */
+int pathNeedsNormalization(const char *target, size_t length) {
+    size_t i = 0;
+    if (length > 1 && target[length - 1] == '/') {
+        return 1;
+    }
+#ifdef __SSE2__
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i question = _mm_set1_epi8('?');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i dot = _mm_set1_epi8('.');
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(target + i));
+        __m128i next = _mm_loadu_si128((const __m128i *)(target + i + 1));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(bytes, percent), _mm_cmpeq_epi8(bytes, question));
+        __m128i segment = _mm_and_si128(_mm_cmpeq_epi8(bytes, slash),
+                                        _mm_or_si128(_mm_cmpeq_epi8(next, slash), _mm_cmpeq_epi8(next, dot)));
+        if (_mm_movemask_epi8(_mm_or_si128(special, segment)) != 0) {
+            return 1;
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        char c = target[i];
+        if (c == '%' || c == '?' || (c == '/' && (target[i + 1] == '/' || target[i + 1] == '.'))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Value of a hexadecimal digit, or -1 if c is not one.
+ */
+int hexDigitValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Split the query off the request target and normalize the path in a single pass.
+ *
+ * The path is percent-decoded, empty and "." segments are dropped, ".." segments
+ * remove the previous segment (never climbing above the root) and a trailing slash is
+ * removed, so "/test/", "/%74est", "/a/../test" and "/test?x=1" all become "/test".
+ * Dot segments are recognised after decoding, so "/%2e%2e/" cannot sneak past.
+ * Encoded slashes and NUL bytes are rejected rather than decoded, since they would
+ * change the segment structure after it was checked.
+ *
+ * When pathNeedsNormalization() finds nothing to do, the path is the target itself
+ * and nothing is copied; otherwise the normalized path is written to the arena.
+ *
+ * @param request The request whose target is set; path, path_length and query are filled in.
+ * @param length Length of the target in bytes.
+ * @param arena Arena the normalized path is written to when it differs from the target.
+ * @return 0 on success, 400 if the target is not a valid origin-form path.
+ */
+int normalizeRequestPath(HttpRequest *request, size_t length, RequestArena *arena) {
+    const char *target = request->target;
+    if (target[0] != '/') {
+        return 400;
+    }
+    if (!pathNeedsNormalization(target, length)) {
+        request->path = target;
+        request->path_length = length;
+        return 0;
+    }
+
+    const char *query = memchr(target, '?', length);
+    size_t path_length = length;
+    if (query != NULL) {
+        request->query = query + 1;
+        path_length = query - target;
+    }
+
+    // Decoding and dropping segments only ever shrinks the path
+    char *out = arenaAllocate(arena, path_length + 2);
+    if (out == NULL) {
+        return 431;
+    }
+    size_t out_length = 0;
+    size_t i = 0;
+    while (i < path_length) {
+        // Copy one segment, including its leading '/', decoding as we go
+        size_t segment_start = out_length;
+        out[out_length++] = '/';
+        for (i++; i < path_length && target[i] != '/'; i++) {
+            char c = target[i];
+            if (c == '%') {
+                int high = i + 2 < path_length ? hexDigitValue(target[i + 1]) : -1;
+                int low = high >= 0 ? hexDigitValue(target[i + 2]) : -1;
+                if (low < 0) {
+                    return 400;
+                }
+                c = (char)(high * 16 + low);
+                if (c == '/' || c == '\0') {
+                    return 400;
+                }
+                i += 2;
+            }
+            out[out_length++] = c;
+        }
+
+        size_t segment_length = out_length - segment_start - 1;
+        const char *segment = out + segment_start + 1;
+        if (segment_length == 0 || (segment_length == 1 && segment[0] == '.')) {
+            out_length = segment_start;
+        } else if (segment_length == 2 && segment[0] == '.' && segment[1] == '.') {
+            out_length = segment_start;
+            while (out_length > 0 && out[--out_length] != '/') {
+            }
+        }
+    }
+    if (out_length == 0) {
+        out[out_length++] = '/';
+    }
+    out[out_length] = '\0';
+
+    request->path = out;
+    request->path_length = out_length;
+    return 0;
+}
+
+/**
+ * @brief Parse the request line and headers of an HTTP request in place.
+ *
+ * The method, path, version and every header name and value are NUL-terminated inside
+ * the connection buffer and referenced from the HttpRequest, so nothing is copied and
+ * no length limit is imposed by the structure itself. The limits that do apply come
+ * from serverOptions and are reported with the matching status code.
+ *
+ * @param buffer The received bytes, starting with the request line.
+ * @param header_length Length of the header block including the terminating blank line.
+ * @param request The request to fill in.
+ * @param arena Arena the header table is allocated from.
+ * @return 0 on success, or the HTTP status code to reject the request with
+ *         (400 Bad Request, 414 URI Too Long or 431 Request Header Fields Too Large).
+ */
+int parseHttpRequest(char *buffer, size_t header_length, HttpRequest *request, RequestArena *arena,
+                     const ListenerPolicy *policy) {
+    memset(request, 0, sizeof(*request));
+    request->policy = policy;
+    char *end = buffer + header_length;
+
+    // Request line: <method> SP <path> SP <version> CRLF
+    char *line_end = memchr(buffer, '\n', header_length);
+    if (line_end == NULL) {
+        return 400;
+    }
+    char *method = buffer;
+    char *space = memchr(method, ' ', line_end - method);
+    if (space == NULL || space == method) {
+        return 400;
+    }
+    *space = '\0';
+    char *path = space + 1;
+    space = memchr(path, ' ', line_end - path);
+    if (space == NULL || space == path) {
+        return 400;
+    }
+    *space = '\0';
+    char *version = space + 1;
+    char *version_end = (line_end > version && line_end[-1] == '\r') ? line_end - 1 : line_end;
+    *version_end = '\0';
+    if (strncmp(version, "HTTP/", 5) != 0) {
+        return 400;
+    }
+    request->arena = arena;
+    request->method = method;
+    request->target = path;
+    request->version = version;
+    if ((size_t)(space - path) > (size_t)policy->max_uri_length) {
+        return 414;
+    }
+    int status = normalizeRequestPath(request, space - path, arena);
+    if (status != 0) {
+        return status;
+    }
+
+    // Header lines: <name> ":" OWS <value> OWS CRLF, up to the blank line
+    HttpHeader *headers = arenaAllocate(arena, policy->max_headers * sizeof(HttpHeader));
+    if (headers == NULL) {
+        return 431;
+    }
+    request->headers = headers;
+    for (char *line = line_end + 1; line < end; line = line_end + 1) {
+        line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) {
+            break;
+        }
+        char *content_end = (line_end > line && line_end[-1] == '\r') ? line_end - 1 : line_end;
+        if (content_end == line) {
+            break;
+        }
+        if (request->header_count == (size_t)policy->max_headers) {
+            return 431;
+        }
+        char *colon = memchr(line, ':', content_end - line);
+        if (colon == NULL || colon == line) {
+            return 400;
+        }
+        *colon = '\0';
+        char *value = colon + 1;
+        while (value < content_end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        char *value_end = content_end;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
+        }
+        *value_end = '\0';
+        headers[request->header_count].name = line;
+        headers[request->header_count].value = value;
+        request->header_count++;
+    }
+
+    // Parse Content-Length header
+    const char *content_length = getHeader(request, "Content-Length");
+    if (content_length != NULL) {
+        char *number_end;
+        errno = 0;
+        unsigned long long value = strtoull(content_length, &number_end, 10);
+        if (number_end == content_length || *number_end != '\0' || errno == ERANGE || content_length[0] == '-') {
+            return 400;
+        }
+        request->content_length = value;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Split a list of name=value pairs into the request arena.
+ *
+ * The input is copied into the arena and split in place. Query strings are
+ * percent-decoded (with '+' meaning a space); cookie values are kept as sent, minus
+ * optional surrounding quotes, and whitespace around cookie pairs is skipped.
+ *
+ * @param input The raw list, e.g. "a=1&b=2" or "id=42; theme=dark".
+ * @param separator The pair separator ('&' or ';').
+ * @param is_query Non-zero for query string rules, zero for Cookie header rules.
+ * @param arena The arena to allocate from.
+ * @param count Receives the number of pairs.
+ * @return The pairs, or NULL if there are none or the arena is exhausted.
+ */
+HttpParameter *parseParameterList(const char *input, char separator, int is_query,
+                                  RequestArena *arena, size_t *count) {
+    *count = 0;
+    size_t length = strlen(input);
+    size_t capacity = 1;
+    for (size_t i = 0; i < length; i++) {
+        capacity += input[i] == separator;
+    }
+    char *copy = arenaAllocate(arena, length + 1);
+    HttpParameter *parameters = arenaAllocate(arena, capacity * sizeof(HttpParameter));
+    if (copy == NULL || parameters == NULL) {
+        return NULL;
+    }
+    memcpy(copy, input, length + 1);
+
+    char *pair = copy;
+    while (pair != NULL) {
+        char *next = strchr(pair, separator);
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        if (!is_query) {
+            pair += strspn(pair, " \t");
+        }
+        char *value = strchr(pair, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+        } else {
+            value = pair + strlen(pair);
+        }
+
+        if (is_query) {
+            // Decode in place: the decoded value is never longer than the encoded one
+            char *out = value;
+            for (char *in = value; *in != '\0'; in++) {
+                int high, low;
+                if (*in == '+') {
+                    *out++ = ' ';
+                } else if (*in == '%' && (high = hexDigitValue(in[1])) >= 0 && (low = hexDigitValue(in[2])) >= 0) {
+                    *out++ = (char)(high * 16 + low);
+                    in += 2;
+                } else {
+                    *out++ = *in;
+                }
+            }
+            *out = '\0';
+        } else {
+            size_t value_length = strcspn(value, " \t");
+            value[value_length] = '\0';
+            if (value_length >= 2 && value[0] == '"' && value[value_length - 1] == '"') {
+                value[value_length - 1] = '\0';
+                value++;
+            }
+        }
+
+        if (pair[0] != '\0') {
+            parameters[*count].name = pair;
+            parameters[*count].value = value;
+            (*count)++;
+        }
+        pair = next;
+    }
+    return parameters;
+}
+
+/**
+ * @brief Get a query string parameter, parsing the query string on first use.
+ *
+ * Requests whose handler never asks for a parameter never pay for parsing. Names are
+ * compared as sent (parameter names are not decoded).
+ *
+ * @param request The request.
+ * @param name The parameter name.
+ * @return The decoded value of the first parameter with that name, or NULL if absent.
+ */
+const char *getQueryParameter(HttpRequest *request, const char *name) {
+    if (!request->query_parsed) {
+        request->query_parsed = 1;
+        if (request->query != NULL && request->arena != NULL) {
+            request->query_parameters = parseParameterList(request->query, '&', 1, request->arena,
+                                                           &request->query_parameter_count);
+        }
+    }
+    for (size_t i = 0; i < request->query_parameter_count; i++) {
+        if (strcmp(request->query_parameters[i].name, name) == 0) {
+            return request->query_parameters[i].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Get a cookie sent with the request, parsing the Cookie header on first use.
+ *
+ * @param request The request.
+ * @param name The cookie name.
+ * @return The cookie's value, or NULL if the request did not send it.
+ */
+const char *getCookie(HttpRequest *request, const char *name) {
+    if (!request->cookies_parsed) {
+        request->cookies_parsed = 1;
+        const char *header = getHeader(request, "Cookie");
+        if (header != NULL && request->arena != NULL) {
+            request->cookies = parseParameterList(header, ';', 0, request->arena, &request->cookie_count);
+        }
+    }
+    for (size_t i = 0; i < request->cookie_count; i++) {
+        if (strcmp(request->cookies[i].name, name) == 0) {
+            return request->cookies[i].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief The reason phrase for an HTTP status code.
+ */
+const char *httpStatusMessage(int status_code) {
+    switch (status_code) {
+        case 200: return "OK";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 411: return "Length Required";
+        case 413: return "Content Too Large";
+        case 414: return "URI Too Long";
+        case 417: return "Expectation Failed";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        default: return "Unknown";
+    }
+}
+
+/**
+ * @brief Format a time as an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ */
+void formatHttpDate(time_t time_value, char *buffer, size_t size) {
+    struct tm tm;
+    gmtime_r(&time_value, &tm);
+    strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/**
+ * @brief The current time as an HTTP date, formatted at most once per second.
+ */
+const char *currentHttpDate(void) {
+    static time_t formatted_at = -1;
+    static char date[HTTP_DATE_SIZE];
+    time_t now = time(NULL);
+    if (now != formatted_at) {
+        formatHttpDate(now, date, sizeof(date));
+        formatted_at = now;
+    }
+    return date;
+}
+
+/**
+ * @brief Get the Cache-Control and Expires header lines of a policy for the current second.
+ */
+const char *cachePolicyHeader(CachePolicy *policy) {
+    time_t now = time(NULL);
+    if (policy->header_time != now) {
+        char expires[HTTP_DATE_SIZE];
+        formatHttpDate(now + policy->max_age, expires, sizeof(expires));
+        snprintf(policy->header, sizeof(policy->header), "Cache-Control: %s\r\nExpires: %s\r\n",
+                 policy->cache_control, expires);
+        policy->header_time = now;
+    }
+    return policy->header;
+}
+
+/**
+ * @brief Caching policies by file extension, for files whose route sets none.
+ */
+static const struct {
+    const char *extension;
+    CachePolicy *policy;
+} extensionCachePolicies[] = {
+    {".css", &assetCachePolicy},
+    {".js", &assetCachePolicy},
+    {".svg", &assetCachePolicy},
+    {".png", &assetCachePolicy},
+    {".jpg", &assetCachePolicy},
+    {".jpeg", &assetCachePolicy},
+    {".gif", &assetCachePolicy},
+    {".webp", &assetCachePolicy},
+    {".ico", &assetCachePolicy},
+    {".woff2", &assetCachePolicy},
+};
+
+/**
+ * @brief Check whether a file name carries a content fingerprint, as in "app.3f9a2c1b.js".
+ *
+ * A fingerprint is a run of at least FINGERPRINT_MIN_DIGITS hex digits between a '.'
+ * or '-' and the extension. Build tools change it whenever the content changes, so
+ * such a file can be cached forever.
+ */
+int isFingerprintedPath(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    const char *extension = strrchr(name, '.');
+    if (extension == NULL) {
+        return 0;
+    }
+    const char *start = extension;
+    while (start > name && isxdigit((unsigned char)start[-1])) {
+        start--;
+    }
+    return extension - start >= FINGERPRINT_MIN_DIGITS && start > name && (start[-1] == '.' || start[-1] == '-');
+}
+
+/**
+ * @brief Choose the caching policy for a static file.
+ *
+ * The route's own policy wins; otherwise fingerprinted files are immutable, known asset
+ * types get a short lifetime and everything else (HTML above all) is revalidated.
+ *
+ * @param route The route serving the file, or NULL if it is not served from a route.
+ * @param file The file name.
+ */
+CachePolicy *selectCachePolicy(const RouteMapping *route, const char *file) {
+    if (route != NULL && route->cache_policy != NULL) {
+        return route->cache_policy;
+    }
+    if (isFingerprintedPath(file)) {
+        return &immutableCachePolicy;
+    }
+    const char *extension = strrchr(file, '.');
+    if (extension != NULL && strchr(extension, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(extensionCachePolicies) / sizeof(extensionCachePolicies[0]); i++) {
+            if (strcasecmp(extension, extensionCachePolicies[i].extension) == 0) {
+                return extensionCachePolicies[i].policy;
+            }
+        }
+    }
+    return &revalidateCachePolicy;
+}
+
+/**
+ * @brief Convert an HttpResponse struct to an HTTP response string.
+ *
+ * This function takes an HttpResponse struct and converts it into a well-formed
+ * HTTP response string. The resulting string includes the HTTP status code,
+ * status message, content length, content type, and the response content.
+ *
+ * @param response Pointer to the HttpResponse struct to be converted.
+ * @param size Pointer to a long variable to store the size of the generated string (optional).
+ * @return A dynamically allocated string representing the HTTP response. The caller is responsible
+ * for freeing the memory when it's no longer needed. Returns NULL on allocation failure.
+ */
+char* HttpResponseToString(const HttpResponse *response, long *size) {
+    const char *content_type = response->content_type != NULL ? response->content_type : "text/html;charset=UTF-8";
+    const char *cache_headers = response->cache_headers != NULL ? response->cache_headers : "";
+    const char *etag_name = response->etag[0] != '\0' ? "ETag: " : "";
+    const char *etag_end = response->etag[0] != '\0' ? "\r\n" : "";
+    char length_line[40] = "";
+    if (!response->length_unknown) {
+        snprintf(length_line, sizeof(length_line), "Content-Length: %zu\r\n", response->content_length);
+    }
+    const char *format = "HTTP/1.1 %d %s\r\nDate: %s\r\nContent-Type: %s\r\n%s%s%s%s%s%sConnection: close\r\n\r\n";
+    const char *date = currentHttpDate();
+    int header_length = snprintf(NULL, 0, format, response->status_code, response->status_message, date,
+        content_type, length_line, etag_name, response->etag, etag_end, cache_headers,
+        tracedConnection.headers);
+
+    if (header_length < 0) {
+        // Handle snprintf error
+        fprintf(stderr, "Error in snprintf\n");
+        return NULL;
+    }
+
+    size_t body_length = response->omit_body ? 0 : response->content_length;
+    size_t total_length = header_length + body_length;
+    char *http_response = malloc(total_length + 1);
+    if (http_response == NULL) {
+        // Handle memory allocation failure
+        fprintf(stderr, "Memory allocation error in HttpResponseToString\n");
+        return NULL;
+    }
+
+    snprintf(http_response, header_length + 1, format, response->status_code, response->status_message, date,
+        content_type, length_line, etag_name, response->etag, etag_end, cache_headers,
+        tracedConnection.headers);
+    // Copy the body with memcpy so binary content survives embedded NUL bytes
+    memcpy(http_response + header_length, response->content, body_length);
+    http_response[total_length] = '\0';
+
+    if (size != NULL) {
+        *size = total_length;
+    }
+
+    return http_response;
+}
+
+/**
+ * @brief Media types by file extension, for the Content-Type of static files.
+ */
+static const struct {
+    const char *extension;
+    const char *content_type;
+} contentTypes[] = {
+    {".html", "text/html;charset=UTF-8"},
+    {".htm", "text/html;charset=UTF-8"},
+    {".css", "text/css;charset=UTF-8"},
+    {".js", "text/javascript;charset=UTF-8"},
+    {".json", "application/json"},
+    {".txt", "text/plain;charset=UTF-8"},
+    {".svg", "image/svg+xml"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".webp", "image/webp"},
+    {".ico", "image/x-icon"},
+    {".woff2", "font/woff2"},
+};
+
+/**
+ * @brief Pick the Content-Type of a static file from its extension.
+ *
+ * @param path The file path.
+ * @return The media type; application/octet-stream for unknown extensions.
+ */
+const char *contentTypeForPath(const char *path) {
+    const char *extension = strrchr(path, '.');
+    if (extension != NULL && strchr(extension, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(contentTypes) / sizeof(contentTypes[0]); i++) {
+            if (strcasecmp(extension, contentTypes[i].extension) == 0) {
+                return contentTypes[i].content_type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+/**
+ * @brief Format the entity tag of a file from its size and modification time.
+ *
+ * Both GET and HEAD derive the tag from the same metadata, so a HEAD answered from the
+ * cache index carries the ETag a GET of the same file would.
+ */
+void formatEntityTag(char *etag, size_t etag_size, size_t size, time_t mtime) {
+    snprintf(etag, etag_size, "\"%zx-%llx\"", size, (unsigned long long)mtime);
+}
+
+/**
+ * @brief Fill in the 200 response headers describing a static file.
+ *
+ * Shared by GET and HEAD so both send the same metadata. A request whose If-None-Match
+ * names the current entity tag gets 304 and no body instead.
+ *
+ * @param request The request being answered.
+ * @param route The route the file belongs to (NULL for files not served from a route).
+ * @param file The file name, which determines the type and caching policy.
+ * @param response The response to describe the file in.
+ * @param size The size of the file.
+ * @param mtime The modification time of the file.
+ */
+void describeStaticFile(HttpRequest *request, const RouteMapping *route, const char *file,
+                        HttpResponse *response, size_t size, time_t mtime) {
+    response->status_code = 200;
+    strcpy(response->status_message, "OK");
+    response->content_length = size;
+    response->content_type = contentTypeForPath(file);
+    response->cache_headers = cachePolicyHeader(selectCachePolicy(route, file));
+    formatEntityTag(response->etag, sizeof(response->etag), size, mtime);
+
+    const char *if_none_match = getHeader(request, "If-None-Match");
+    if (if_none_match != NULL && (strcmp(if_none_match, "*") == 0 || strstr(if_none_match, response->etag) != NULL)) {
+        response->status_code = 304;
+        strcpy(response->status_message, "Not Modified");
+        response->omit_body = 1;
+    }
+}
+
+/**
+ * @brief Find the route mapping for a request path in a route table.
+ *
+ * @param routes The route table.
+ * @param route_count Number of entries in routes.
+ * @param path The request path.
+ * @return The matching route mapping, or NULL if no route matches.
+ */
+const RouteMapping *findRoute(const RouteMapping *routes, size_t route_count, const char *path) {
+    for (size_t i = 0; i < route_count; i++) {
+        if (strcmp(path, routes[i].path) == 0) {
+            return &routes[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find the GET route mapping for a request path.
+ *
+ * @param path The request path.
+ * @return The matching route mapping, or NULL if no route matches.
+ */
+const RouteMapping *findGetRoute(const char *path) {
+    return findRoute(getRouteMappings, sizeof(getRouteMappings) / sizeof(RouteMapping), path);
+}
+
+/**
+ * @brief Find the route for a request in the GET or POST table of its listener's policy.
+ *
+ * @param request The parsed request.
+ * @param post Use the POST table instead of the GET table.
+ * @return The matching route mapping, or NULL if no route matches.
+ */
+const RouteMapping *matchRequestRoute(const HttpRequest *request, int post) {
+    const ListenerPolicy *policy = request->policy;
+    const RouteMapping *route = post ? findRoute(policy->post_routes, policy->post_route_count, request->path)
+                                     : findRoute(policy->get_routes, policy->get_route_count, request->path);
+    PROBE(route__matched, tracedConnection.id, request->method, request->path, route != NULL ? route->path : "");
+    return route;
+}
+
+/**
+ * @brief Send a response to the client.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param response The response to send.
+ * @return The response's status code, or 0 if it could not be built.
+ */
+int sendHttpResponse(int client_socket, const HttpResponse *response) {
+    long size;
+    char *response_message = HttpResponseToString(response, &size);
+    if (response_message == NULL) {
+        return 0;
+    }
+    ssize_t bytes_sent = send(client_socket, response_message, size, 0);
+    countBytesSent(bytes_sent);
+
+    if (bytes_sent == -1) {
+        fprintf(stderr, "Error sending response: %s\n", strerror(errno));
+    }
+    printf("Response Sent: \n");
+    printStringWithEscapeChars(response_message);
+    free(response_message);
+    return response->status_code;
+}
+
+/**
+ * @brief Send a response with an empty body for the given status code.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param status_code The HTTP status code to send.
+ * @return status_code, for convenient use in handlers.
+ */
+int sendStatusResponse(int client_socket, int status_code) {
+    HttpResponse response = {0};
+    response.status_code = status_code;
+    snprintf(response.status_message, sizeof(response.status_message), "%s", httpStatusMessage(status_code));
+    response.content_length = 0;
+    response.content = "";
+    sendHttpResponse(client_socket, &response);
+    return status_code;
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief Kinds of template instructions.
+ */
+typedef enum {
+    TEMPLATE_LITERAL,  ///< Copy a chunk of the template source.
+    TEMPLATE_VARIABLE, ///< Insert a query parameter, HTML-escaped.
+    TEMPLATE_FUNCTION, ///< Insert the output of a template function.
+    TEMPLATE_FRAGMENT, ///< Insert a cached rendering of the following instructions.
+} TemplateOpType;
+
+/**
+ * @brief A function templates can call as {{@name}}; writes at most size bytes of HTML to out.
+ *
+ * @return The number of bytes written.
+ */
+typedef size_t (*TemplateFunction)(HttpRequest *request, char *out, size_t size);
+
+/**
+ * @brief One instruction of a compiled template.
+ *
+ * The fragment cache fields are written after fork(), so every worker keeps its own
+ * copy and no locking is needed.
+ */
+typedef struct {
+    TemplateOpType type;         ///< What the instruction does.
+    const char *text;            ///< Literal bytes, or the NUL-terminated variable name.
+    size_t length;               ///< Length of the literal.
+    TemplateFunction function;   ///< Function to call (TEMPLATE_FUNCTION).
+    int ttl;                     ///< Seconds a fragment's rendering is reused (TEMPLATE_FRAGMENT).
+    size_t end;                  ///< Index of the first instruction after the fragment (TEMPLATE_FRAGMENT).
+    char *cached;                ///< Cached rendering of the fragment.
+    size_t cached_length;        ///< Length of the cached rendering.
+    time_t expires_at;           ///< When the cached rendering goes stale.
+} TemplateOp;
+
+/**
+ * @brief A template compiled into an instruction list, served at its own route.
+ */
+typedef struct {
+    char *route;          ///< Request path, the file name without ".tmpl" ("/hello" for hello.tmpl).
+    char *source;         ///< Template file contents, referenced by the literals.
+    TemplateOp *ops;      ///< Instructions in output order.
+    size_t op_count;      ///< Number of instructions.
+} Template;
+
+/**
+ * @brief Templates compiled at startup; shared copy-on-write by all workers.
+ */
+Template *templates = NULL;
+size_t templateCount = 0;
+
+size_t renderCurrentDate(HttpRequest *request, char *out, size_t size) {
+    (void)request;
+    return snprintf(out, size, "%s", currentHttpDate());
+}
+
+size_t renderWorkerId(HttpRequest *request, char *out, size_t size) {
+    (void)request;
+    return snprintf(out, size, "%d", workerId);
+}
+
+size_t renderCacheStats(HttpRequest *request, char *out, size_t size) {
+    (void)request;
+    if (fileCache.index == NULL) {
+        return snprintf(out, size, "disabled");
+    }
+    FileCacheStats *stats = &fileCache.index->stats;
+    return snprintf(out, size, "%zu hits, %zu misses", atomic_load(&stats->hits), atomic_load(&stats->misses));
+}
+
+/**
+ * @brief Functions available to templates as {{@name}}.
+ */
+static const struct {
+    const char *name;
+    TemplateFunction function;
+} templateFunctions[] = {
+    {"date", renderCurrentDate},
+    {"worker", renderWorkerId},
+    {"cache_stats", renderCacheStats},
+};
+
+/**
+ * @brief Append an instruction to a template being compiled.
+ *
+ * @return The new instruction, or NULL on allocation failure.
+ */
+TemplateOp *addTemplateOp(Template *template, size_t *capacity, TemplateOpType type) {
+    if (template->op_count == *capacity) {
+        size_t new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+        TemplateOp *ops = realloc(template->ops, new_capacity * sizeof(TemplateOp));
+        if (ops == NULL) {
+            return NULL;
+        }
+        template->ops = ops;
+        *capacity = new_capacity;
+    }
+    TemplateOp *op = &template->ops[template->op_count++];
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    return op;
+}
+
+/**
+ * @brief Compile template source into an instruction list.
+ *
+ * Text is kept as literal chunks pointing into the source. Tags are:
+ *   {{name}}                 the query parameter "name", HTML-escaped ("" if absent)
+ *   {{@name}}                the output of a template function
+ *   {{#cache N}}..{{/cache}} a fragment rendered once and reused for N seconds
+ * A cached fragment is shared by all requests, so it may not contain variables.
+ *
+ * @param template The template; source must be set. Tag names are NUL-terminated in place.
+ * @param file File name for error messages.
+ * @return 0 on success, -1 on a syntax error (reported on stderr).
+ */
+int compileTemplate(Template *template, const char *file) {
+    size_t capacity = 0;
+    char *cursor = template->source;
+    long fragment = -1;
+    for (;;) {
+        char *tag = strstr(cursor, "{{");
+        size_t literal_length = tag != NULL ? (size_t)(tag - cursor) : strlen(cursor);
+        if (literal_length > 0) {
+            TemplateOp *op = addTemplateOp(template, &capacity, TEMPLATE_LITERAL);
+            if (op == NULL) {
+                return -1;
+            }
+            op->text = cursor;
+            op->length = literal_length;
+        }
+        if (tag == NULL) {
+            break;
+        }
+        char *name = tag + 2;
+        char *close = strstr(name, "}}");
+        if (close == NULL) {
+            fprintf(stderr, "%s: unterminated tag\n", file);
+            return -1;
+        }
+        *close = '\0';
+        cursor = close + 2;
+
+        if (strncmp(name, "#cache ", 7) == 0) {
+            int ttl = atoi(name + 7);
+            TemplateOp *op = fragment == -1 && ttl > 0 ? addTemplateOp(template, &capacity, TEMPLATE_FRAGMENT) : NULL;
+            if (op == NULL) {
+                fprintf(stderr, "%s: invalid or nested {{%s}}\n", file, name);
+                return -1;
+            }
+            op->ttl = ttl;
+            fragment = template->op_count - 1;
+        } else if (strcmp(name, "/cache") == 0) {
+            if (fragment == -1) {
+                fprintf(stderr, "%s: {{/cache}} without {{#cache}}\n", file);
+                return -1;
+            }
+            template->ops[fragment].end = template->op_count;
+            fragment = -1;
+        } else if (name[0] == '@') {
+            TemplateFunction function = NULL;
+            for (size_t i = 0; i < sizeof(templateFunctions) / sizeof(templateFunctions[0]); i++) {
+                if (strcmp(name + 1, templateFunctions[i].name) == 0) {
+                    function = templateFunctions[i].function;
+                }
+            }
+            TemplateOp *op = function != NULL ? addTemplateOp(template, &capacity, TEMPLATE_FUNCTION) : NULL;
+            if (op == NULL) {
+                fprintf(stderr, "%s: unknown function {{%s}}\n", file, name);
+                return -1;
+            }
+            op->function = function;
+        } else {
+            if (name[0] == '\0' || name[strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-")] != '\0') {
+                fprintf(stderr, "%s: invalid variable name {{%s}}\n", file, name);
+                return -1;
+            }
+            if (fragment != -1) {
+                fprintf(stderr, "%s: variable {{%s}} inside a cached fragment\n", file, name);
+                return -1;
+            }
+            TemplateOp *op = addTemplateOp(template, &capacity, TEMPLATE_VARIABLE);
+            if (op == NULL) {
+                return -1;
+            }
+            op->text = name;
+        }
+    }
+    if (fragment != -1) {
+        fprintf(stderr, "%s: {{#cache}} without {{/cache}}\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Compile every "*.tmpl" file in a directory.
+ *
+ * Runs once before the workers are forked, so the file is read and parsed once and
+ * requests only walk the instruction list.
+ *
+ * @param directory The directory to load templates from.
+ * @return The number of templates compiled.
+ */
+int loadTemplates(const char *directory) {
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        return 0;
+    }
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        size_t name_length = strlen(dirent->d_name);
+        if (name_length <= 5 || strcmp(dirent->d_name + name_length - 5, ".tmpl") != 0) {
+            continue;
+        }
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/%s", directory, dirent->d_name);
+        Template template;
+        memset(&template, 0, sizeof(template));
+        long size;
+        template.source = ReadFile(file, &size);
+        template.route = malloc(name_length - 5 + 2);
+        Template *grown = realloc(templates, (templateCount + 1) * sizeof(Template));
+        if (grown != NULL) {
+            templates = grown;
+        }
+        if (template.source == NULL || template.route == NULL || grown == NULL ||
+            (size_t)size != strlen(template.source) || compileTemplate(&template, file) == -1) {
+            fprintf(stderr, "Skipping template %s\n", file);
+            free(template.source);
+            free(template.route);
+            free(template.ops);
+            continue;
+        }
+        snprintf(template.route, name_length - 5 + 2, "/%.*s", (int)(name_length - 5), dirent->d_name);
+        templates[templateCount++] = template;
+    }
+    closedir(dir);
+    return templateCount;
+}
+
+/**
+ * @brief Find the template served at a request path.
+ */
+Template *findTemplate(const char *path) {
+    for (size_t i = 0; i < templateCount; i++) {
+        if (strcmp(path, templates[i].route) == 0) {
+            return &templates[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copy a value into the arena with the HTML special characters escaped.
+ *
+ * @return The escaped value, or NULL if the arena is full.
+ */
+char *escapeHtml(RequestArena *arena, const char *value, size_t *length) {
+    size_t escaped_length = 0;
+    for (const char *c = value; *c != '\0'; c++) {
+        escaped_length += *c == '&' || *c == '\'' ? 5 : *c == '<' || *c == '>' ? 4 : *c == '"' ? 6 : 1;
+    }
+    char *escaped = arenaAllocate(arena, escaped_length + 1);
+    if (escaped == NULL) {
+        return NULL;
+    }
+    char *out = escaped;
+    for (const char *c = value; *c != '\0'; c++) {
+        switch (*c) {
+            case '&': memcpy(out, "&amp;", 5); out += 5; break;
+            case '<': memcpy(out, "&lt;", 4); out += 4; break;
+            case '>': memcpy(out, "&gt;", 4); out += 4; break;
+            case '"': memcpy(out, "&quot;", 6); out += 6; break;
+            case '\'': memcpy(out, "&#39;", 5); out += 5; break;
+            default: *out++ = *c; break;
+        }
+    }
+    *out = '\0';
+    *length = out - escaped;
+    return escaped;
+}
+
+/**
+ * @brief Turn the instructions [begin, end) of a template into I/O vectors.
+ *
+ * Literals and cached fragments are referenced where they are; only variable values
+ * and function output are produced per request, in the request arena.
+ *
+ * @param iov Receives one vector per instruction (at most end - begin).
+ * @return The number of vectors, or -1 if the arena ran out.
+ */
+int renderTemplateOps(Template *template, size_t begin, size_t end, HttpRequest *request, struct iovec *iov);
+
+/**
+ * @brief Get the rendering of a cached fragment, rendering it again if it went stale.
+ *
+ * @return 0 on success, -1 if the fragment could not be rendered.
+ */
+int renderTemplateFragment(Template *template, size_t index, HttpRequest *request) {
+    TemplateOp *op = &template->ops[index];
+    time_t now = time(NULL);
+    if (op->cached != NULL && now < op->expires_at) {
+        return 0;
+    }
+    struct iovec *parts = arenaAllocate(request->arena, (op->end - index) * sizeof(struct iovec));
+    int count = parts != NULL ? renderTemplateOps(template, index + 1, op->end, request, parts) : -1;
+    if (count == -1) {
+        return -1;
+    }
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        length += parts[i].iov_len;
+    }
+    char *cached = malloc(length + 1);
+    if (cached == NULL) {
+        return -1;
+    }
+    char *out = cached;
+    for (int i = 0; i < count; i++) {
+        memcpy(out, parts[i].iov_base, parts[i].iov_len);
+        out += parts[i].iov_len;
+    }
+    free(op->cached);
+    op->cached = cached;
+    op->cached_length = length;
+    op->expires_at = now + op->ttl;
+    return 0;
+}
+
+int renderTemplateOps(Template *template, size_t begin, size_t end, HttpRequest *request, struct iovec *iov) {
+    int count = 0;
+    for (size_t i = begin; i < end; i++) {
+        TemplateOp *op = &template->ops[i];
+        switch (op->type) {
+            case TEMPLATE_LITERAL:
+                iov[count].iov_base = (void *)op->text;
+                iov[count].iov_len = op->length;
+                break;
+            case TEMPLATE_VARIABLE: {
+                const char *value = getQueryParameter(request, op->text);
+                char *escaped = escapeHtml(request->arena, value != NULL ? value : "", &iov[count].iov_len);
+                if (escaped == NULL) {
+                    return -1;
+                }
+                iov[count].iov_base = escaped;
+                break;
+            }
+            case TEMPLATE_FUNCTION: {
+                char *out = arenaAllocate(request->arena, TEMPLATE_VALUE_SIZE);
+                if (out == NULL) {
+                    return -1;
+                }
+                size_t length = op->function(request, out, TEMPLATE_VALUE_SIZE);
+                iov[count].iov_base = out;
+                iov[count].iov_len = length < TEMPLATE_VALUE_SIZE ? length : TEMPLATE_VALUE_SIZE - 1;
+                break;
+            }
+            case TEMPLATE_FRAGMENT:
+                if (renderTemplateFragment(template, i, request) == -1) {
+                    return -1;
+                }
+                iov[count].iov_base = op->cached;
+                iov[count].iov_len = op->cached_length;
+                i = op->end - 1;
+                break;
+        }
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Write all of an I/O vector array to the client, continuing after partial writes.
+ *
+ * The bytes written are counted in the worker's connection slot as they go out.
+ *
+ * @return 0 on success, -1 on a write error.
+ */
+int writeAllVectors(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        countBytesSent(written);
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Render a template and send it with a single gathered write.
+ *
+ * The response header goes in the first vector, followed by the template's vectors,
+ * so the page is never copied into one contiguous buffer. A HEAD request is rendered
+ * too, so that Content-Length is exact, but only the header vector is written.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param template The template to render.
+ * @param request The request, whose query parameters fill the variables.
+ * @param content_length Receives the size of the body that was sent.
+ * @return The HTTP status code of the response.
+ */
+int sendTemplate(int client_socket, Template *template, HttpRequest *request, size_t *content_length) {
+    struct iovec *iov = arenaAllocate(request->arena, (template->op_count + 1) * sizeof(struct iovec));
+    int count = iov != NULL ? renderTemplateOps(template, 0, template->op_count, request, iov + 1) : -1;
+    if (count == -1) {
+        return sendStatusResponse(client_socket, 500);
+    }
+
+    HttpResponse response = {0};
+    response.status_code = 200;
+    strcpy(response.status_message, "OK");
+    for (int i = 1; i <= count; i++) {
+        response.content_length += iov[i].iov_len;
+    }
+    response.cache_headers = cachePolicyHeader(&revalidateCachePolicy);
+    response.omit_body = 1;
+    long header_length;
+    char *header = HttpResponseToString(&response, &header_length);
+    if (header == NULL) {
+        return sendStatusResponse(client_socket, 500);
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_length;
+    int head_only = isHeadRequest(request);
+    if (writeAllVectors(client_socket, iov, head_only ? 1 : count + 1) == -1) {
+        fprintf(stderr, "Error sending template: %s\n", strerror(errno));
+    }
+    free(header);
+    *content_length = head_only ? 0 : response.content_length;
+    return response.status_code;
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief One piece of a page with server-side includes: a run of the page or an included file.
+ */
+typedef struct {
+    size_t offset;  ///< Start of the run in the page (literal segments).
+    size_t length;  ///< Length of the run (literal segments).
+    char *include;  ///< Path of the included file (NULL = literal segment).
+} IncludeSegment;
+
+/**
+ * @brief What scanning an HTML page found, valid for one size and mtime of the page.
+ */
+typedef struct {
+    const char *path;                           ///< File path of the page (NULL = empty slot).
+    size_t size;                                ///< Size of the page the scan was made for.
+    time_t mtime;                               ///< Modification time of that page.
+    int segment_count;                          ///< Number of segments (0 = the page includes nothing).
+    IncludeSegment segments[SSI_MAX_SEGMENTS];  ///< The page in output order.
+    char *early_hints;                          ///< Prebuilt 103 response preloading the page's CSS and JS (NULL = none).
+} ScannedPage;
+
+/**
+ * @brief Pages scanned for include directives and subresources by this process, by path hash.
+ *
+ * A page is scanned once when it is first served or has changed; after that a request
+ * only looks up the result.
+ */
+ScannedPage scannedPages[SSI_PAGE_SLOTS];
+
+/**
+ * @brief Check whether a file is served as HTML and may therefore contain include directives.
+ */
+int mayContainIncludes(const char *path) {
+    return strncmp(contentTypeForPath(path), "text/html", 9) == 0;
+}
+
+/**
+ * @brief Split a page at its <!--#include file="..." --> directives.
+ *
+ * Included paths are relative to the page's directory and may not leave it; an
+ * unusable directive is left in the page as it is, like any other comment.
+ *
+ * @param page The slot to fill; path, size and mtime must be set.
+ * @param content The page contents.
+ */
+void scanPageIncludes(ScannedPage *page, const char *content) {
+    const char *directory_end = strrchr(page->path, '/');
+    int directory_length = directory_end != NULL ? (int)(directory_end - page->path) : 1;
+    const char *directory = directory_end != NULL ? page->path : ".";
+    size_t position = 0;
+    size_t literal_start = 0;
+    page->segment_count = 0;
+
+    while (page->segment_count + 2 < SSI_MAX_SEGMENTS) {
+        const char *directive = memmem(content + position, page->size - position, "<!--#include file=\"", 19);
+        if (directive == NULL) {
+            break;
+        }
+        const char *name = directive + 19;
+        const char *name_end = memchr(name, '"', content + page->size - name);
+        const char *directive_end = name_end != NULL ? memmem(name_end, content + page->size - name_end, "-->", 3) : NULL;
+        if (directive_end == NULL) {
+            break;
+        }
+        position = directive_end + 3 - content;
+
+        int name_length = name_end - name;
+        if (name_length == 0 || name[0] == '/' || memmem(name, name_length, "..", 2) != NULL) {
+            continue;
+        }
+        char *include = malloc(directory_length + name_length + 2);
+        if (include == NULL) {
+            continue;
+        }
+        snprintf(include, directory_length + name_length + 2, "%.*s/%.*s", directory_length, directory, name_length, name);
+
+        IncludeSegment *literal = &page->segments[page->segment_count++];
+        literal->offset = literal_start;
+        literal->length = directive - content - literal_start;
+        literal->include = NULL;
+        IncludeSegment *included = &page->segments[page->segment_count++];
+        memset(included, 0, sizeof(*included));
+        included->include = include;
+        literal_start = position;
+    }
+
+    if (page->segment_count > 0) {
+        IncludeSegment *literal = &page->segments[page->segment_count++];
+        literal->offset = literal_start;
+        literal->length = page->size - literal_start;
+        literal->include = NULL;
+    }
+}
+
+/**
+ * @brief Check whether this process has scanned the given version of a page.
+ */
+int pageScanKnown(const char *path, size_t size, time_t mtime) {
+    const ScannedPage *page = &scannedPages[hashString(path) % SSI_PAGE_SLOTS];
+    return page->path != NULL && strcmp(page->path, path) == 0 && page->size == size && page->mtime == mtime;
+}
+
+/**
+ * @brief Extract the value of a quoted attribute from a tag.
+ *
+ * @param tag The tag, from '<' up to (not including) tag_end.
+ * @param name The attribute with its equals sign and quote, e.g. "href=\"".
+ * @param length Receives the length of the value.
+ * @return The value (not NUL-terminated), or NULL if the tag lacks the attribute.
+ */
+const char *findTagAttribute(const char *tag, const char *tag_end, const char *name, size_t *length) {
+    size_t name_length = strlen(name);
+    const char *value = memmem(tag, tag_end - tag, name, name_length);
+    if (value == NULL || !isspace((unsigned char)value[-1])) {
+        return NULL;
+    }
+    value += name_length;
+    const char *value_end = memchr(value, '"', tag_end - value);
+    if (value_end == NULL) {
+        return NULL;
+    }
+    *length = value_end - value;
+    return value;
+}
+
+/**
+ * @brief Build the 103 Early Hints response for the stylesheets and scripts a page references.
+ *
+ * Only plain <link rel="stylesheet" href="..."> and <script src="..."> tags are
+ * recognised, up to PRELOAD_MAX_LINKS of them; URLs that could not be written into a
+ * header as they are, are skipped.
+ *
+ * @param page The slot to fill; path and size must be set.
+ * @param content The page contents.
+ */
+void scanPagePreloads(ScannedPage *page, const char *content) {
+    char hints[PRELOAD_MAX_LINKS * (PRELOAD_MAX_URL + 40) + 64];
+    int hints_length = snprintf(hints, sizeof(hints), "HTTP/1.1 103 Early Hints\r\n");
+    int link_count = 0;
+    const char *end = content + page->size;
+    const char *tag = content;
+    page->early_hints = NULL;
+
+    while (link_count < PRELOAD_MAX_LINKS && (tag = memchr(tag, '<', end - tag)) != NULL) {
+        const char *tag_end = memchr(tag, '>', end - tag);
+        if (tag_end == NULL) {
+            break;
+        }
+        const char *url = NULL;
+        const char *destination = NULL;
+        size_t url_length = 0;
+        if (strncasecmp(tag, "<link", 5) == 0 && isspace((unsigned char)tag[5]) &&
+            memmem(tag, tag_end - tag, "rel=\"stylesheet\"", 16) != NULL) {
+            url = findTagAttribute(tag, tag_end, "href=\"", &url_length);
+            destination = "style";
+        } else if (strncasecmp(tag, "<script", 7) == 0 && isspace((unsigned char)tag[7])) {
+            url = findTagAttribute(tag, tag_end, "src=\"", &url_length);
+            destination = "script";
+        }
+        tag = tag_end;
+
+        int usable = url != NULL && url_length > 0 && url_length <= PRELOAD_MAX_URL;
+        for (size_t i = 0; usable && i < url_length; i++) {
+            usable = url[i] > ' ' && url[i] < 0x7f && url[i] != '<' && url[i] != '>' && url[i] != ',';
+        }
+        if (usable) {
+            hints_length += snprintf(hints + hints_length, sizeof(hints) - hints_length,
+                                     "Link: <%.*s>; rel=preload; as=%s\r\n", (int)url_length, url, destination);
+            link_count++;
+        }
+    }
+    if (link_count > 0) {
+        snprintf(hints + hints_length, sizeof(hints) - hints_length, "\r\n");
+        page->early_hints = strdup(hints);
+    }
+}
+
+/**
+ * @brief Find the scan of an HTML page, scanning the page if it is new or has changed.
+ *
+ * @param path The file path of the page.
+ * @param content The page contents, or NULL to only look up an existing scan.
+ * @param size The current size of the page.
+ * @param mtime The current modification time of the page.
+ * @return The scan, or NULL if the file is not HTML (or not scanned and content is NULL).
+ */
+ScannedPage *findPageScan(const char *path, const char *content, size_t size, time_t mtime) {
+    if (!mayContainIncludes(path)) {
+        return NULL;
+    }
+    ScannedPage *page = &scannedPages[hashString(path) % SSI_PAGE_SLOTS];
+    if (!pageScanKnown(path, size, mtime)) {
+        if (content == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < page->segment_count; i++) {
+            free(page->segments[i].include);
+        }
+        free(page->early_hints);
+        page->path = path;
+        page->size = size;
+        page->mtime = mtime;
+        scanPageIncludes(page, content);
+        scanPagePreloads(page, content);
+    }
+    return page;
+}
+
+/**
+ * @brief Find the segment list of a page, scanning the page if it is new or has changed.
+ *
+ * @return The page's segment list, or NULL if it includes nothing (or is not known and
+ *         content is NULL).
+ */
+ScannedPage *findPageIncludes(const char *path, const char *content, size_t size, time_t mtime) {
+    ScannedPage *page = findPageScan(path, content, size, mtime);
+    return page != NULL && page->segment_count > 0 ? page : NULL;
+}
+
+/**
+ * @brief The contents of one included file, pinned in the cache or read from disk.
+ */
+typedef struct {
+    FileCacheHandle cached; ///< The file as handed out by the cache, if it could load it.
+    char *uncached;         ///< Contents read from disk, if it did not.
+    const char *data;       ///< The contents ("" if the file could not be read).
+    size_t size;            ///< Size of the contents.
+    time_t mtime;           ///< Modification time of the file.
+} IncludedFile;
+
+/**
+ * @brief Load an included file, from the cache when possible.
+ */
+void loadIncludedFile(const char *path, IncludedFile *file) {
+    memset(file, 0, sizeof(*file));
+    file->data = "";
+    if (fileCacheAcquire(&fileCache, path, &file->cached) != -1) {
+        file->data = file->cached.data;
+        file->size = file->cached.size;
+        file->mtime = file->cached.mtime;
+        return;
+    }
+    struct stat file_stat;
+    long size;
+    if (stat(path, &file_stat) == 0 && (file->uncached = loadAssetFile(path, &size)) != NULL) {
+        file->data = file->uncached;
+        file->size = size;
+        file->mtime = file_stat.st_mtime;
+    } else {
+        fprintf(stderr, "Cannot include %s\n", path);
+    }
+}
+
+/**
+ * @brief Release an included file loaded by loadIncludedFile().
+ */
+void releaseIncludedFile(IncludedFile *file) {
+    fileCacheRelease(&file->cached);
+    free(file->uncached);
+}
+
+/**
+ * @brief Send a page with its includes, gathered straight from the cached files.
+ *
+ * Every segment is a vector into the page's or an included file's cache entry, so a
+ * header shared by a hundred pages is stored once and never copied into a response.
+ * The ETag covers the assembled page: its total size and the newest mtime of its parts.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param request The request being answered.
+ * @param route The route of the page.
+ * @param page The page's segment list.
+ * @param content The page contents.
+ * @param mtime The modification time of the page.
+ * @param content_length Receives the size of the body that was sent.
+ * @return The HTTP status code of the response.
+ */
+int sendIncludePage(int client_socket, HttpRequest *request, const RouteMapping *route, const ScannedPage *page,
+                    const char *content, time_t mtime, size_t *content_length) {
+    IncludedFile files[SSI_MAX_SEGMENTS];
+    struct iovec iov[SSI_MAX_SEGMENTS + 1];
+    size_t size = 0;
+    int file_count = 0;
+    for (int i = 0; i < page->segment_count; i++) {
+        const IncludeSegment *segment = &page->segments[i];
+        if (segment->include != NULL) {
+            IncludedFile *file = &files[file_count++];
+            loadIncludedFile(segment->include, file);
+            iov[i + 1].iov_base = (void *)file->data;
+            iov[i + 1].iov_len = file->size;
+            mtime = file->mtime > mtime ? file->mtime : mtime;
+        } else {
+            iov[i + 1].iov_base = (void *)(content + segment->offset);
+            iov[i + 1].iov_len = segment->length;
+        }
+        size += iov[i + 1].iov_len;
+    }
+
+    HttpResponse response = {0};
+    describeStaticFile(request, route, route->link, &response, size, mtime);
+    int send_body = !response.omit_body;
+    response.omit_body = 1; // The body goes out from the segments, not through the header buffer
+    long header_length;
+    char *header = HttpResponseToString(&response, &header_length);
+    int status_code = 500;
+    if (header != NULL) {
+        iov[0].iov_base = header;
+        iov[0].iov_len = header_length;
+        if (writeAllVectors(client_socket, iov, send_body ? page->segment_count + 1 : 1) == -1) {
+            fprintf(stderr, "Error sending response: %s\n", strerror(errno));
+        }
+        free(header);
+        status_code = response.status_code;
+        *content_length = send_body ? size : 0;
+    }
+    for (int i = 0; i < file_count; i++) {
+        releaseIncludedFile(&files[i]);
+    }
+    return status_code;
+}
+
+/**
+ * @brief Work out the size and mtime of an assembled page without reading any part of it.
+ *
+ * @param page The page's segment list.
+ * @param size Receives the size of the assembled page.
+ * @param mtime In: the page's mtime. Out: the newest mtime of the page and its includes.
+ * @return 0 on success, -1 if the served size of an included file is not known yet.
+ */
+int describeIncludePage(const ScannedPage *page, size_t *size, time_t *mtime) {
+    int result = 0;
+    *size = 0;
+    for (int i = 0; i < page->segment_count; i++) {
+        const IncludeSegment *segment = &page->segments[i];
+        if (segment->include == NULL) {
+            *size += segment->length;
+            continue;
+        }
+        size_t file_size;
+        time_t file_mtime;
+        int found = fileCachePeek(&fileCache, segment->include, &file_size, &file_mtime) == 0 ? 0 :
+                    statAssetFile(segment->include, &file_size, &file_mtime);
+        if (found == -1) {
+            continue; // Sent as an empty include
+        }
+        if (found == 1) {
+            result = -1;
+        }
+        *size += file_size;
+        *mtime = file_mtime > *mtime ? file_mtime : *mtime;
+    }
+    return result;
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief A regular file inside the site archive.
+ */
+typedef struct {
+    uint64_t hash;  ///< hashString() of path (0 = empty slot).
+    char *path;     ///< Request path of the member, e.g. "/css/site.css".
+    off_t offset;   ///< Offset of the member's contents in the archive.
+    size_t size;    ///< Size of the contents.
+    time_t mtime;   ///< Modification time recorded in the archive.
+} ArchiveMember;
+
+/**
+ * @brief A tar archive whose members are served as static files.
+ *
+ * The index is built once at startup, before the workers are forked. Serving a member
+ * is a hash lookup and a sendfile() from the one archive descriptor at the member's
+ * offset: no open() or stat() per file, and a deployment is a single file copy.
+ */
+typedef struct {
+    int fd;                   ///< The archive, open for the lifetime of the server (-1 = none).
+    ArchiveMember *members;   ///< Open-addressed table keyed by request path.
+    size_t capacity;          ///< Number of slots in members (a power of two).
+    size_t count;             ///< Number of members indexed.
+} SiteArchive;
+
+/**
+ * @brief The site archive given with --archive.
+ */
+SiteArchive siteArchive = {.fd = -1};
+
+/**
+ * @brief Parse a NUL- or space-terminated octal field of a tar header.
+ *
+ * @return The value, or -1 if the field is not plain octal.
+ */
+long long parseTarNumber(const char *field, size_t length) {
+    long long value = 0;
+    size_t i = 0;
+    while (i < length && field[i] == ' ') {
+        i++;
+    }
+    if (i == length || field[i] < '0' || field[i] > '7') {
+        return -1;
+    }
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+/**
+ * @brief Check the header checksum of a tar block, which guards against reading garbage.
+ */
+int tarChecksumValid(const unsigned char *header) {
+    long long expected = parseTarNumber((const char *)header + 148, 8);
+    long long sum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += i >= 148 && i < 156 ? ' ' : header[i];
+    }
+    return expected == sum;
+}
+
+/**
+ * @brief Find the slot of a request path in the archive index.
+ *
+ * @return The member's slot, or the empty slot it would go in.
+ */
+ArchiveMember *findArchiveSlot(SiteArchive *archive, uint64_t hash, const char *path) {
+    size_t mask = archive->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        ArchiveMember *member = &archive->members[i];
+        if (member->hash == 0 || (member->hash == hash && strcmp(member->path, path) == 0)) {
+            return member;
+        }
+    }
+}
+
+/**
+ * @brief Find the path record in the data of a pax extended header.
+ *
+ * The data is a list of "<length> <key>=<value>\n" records.
+ *
+ * @param records The data of the extended header.
+ * @param size Size of the data.
+ * @param path Receives the start of the path value.
+ * @param length Receives the length of the path value.
+ * @return 1 if a path record was found, 0 otherwise.
+ */
+int findPaxPath(const char *records, size_t size, const char **path, size_t *length) {
+    size_t offset = 0;
+    while (offset < size) {
+        size_t record_length = 0;
+        size_t position = offset;
+        while (position < size && records[position] >= '0' && records[position] <= '9') {
+            record_length = record_length * 10 + (records[position++] - '0');
+        }
+        if (position >= size || records[position] != ' ' || record_length <= position - offset + 1 ||
+            record_length > size - offset) {
+            return 0; // Malformed
+        }
+        const char *key = records + position + 1;
+        const char *end = records + offset + record_length - 1; // The record's newline
+        if (end - key > 5 && memcmp(key, "path=", 5) == 0) {
+            *path = key + 5;
+            *length = end - *path;
+            return 1;
+        }
+        offset += record_length;
+    }
+    return 0;
+}
+
+/**
+ * @brief Open a tar archive and index its regular files by request path.
+ *
+ * Member "css/site.css" (or "./css/site.css") is served at "/css/site.css". Plain
+ * ustar headers are understood, including the prefix field, as are the GNU ('L') and
+ * pax ('x') records that carry the name of the following member when it is too long
+ * for its header. A member whose name is still too long to serve is skipped.
+ *
+ * @param path The archive file.
+ * @return 0 on success, -1 if the archive cannot be read.
+ */
+int openSiteArchive(SiteArchive *archive, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat archive_stat;
+    if (fd == -1 || fstat(fd, &archive_stat) == -1) {
+        fprintf(stderr, "Cannot open archive %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t length = archive_stat.st_size;
+    const unsigned char *data = length > 0 ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map archive %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // One pass to size the table, one to fill it
+    size_t member_count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            archive->capacity = 16;
+            while (archive->capacity < member_count * 2) {
+                archive->capacity *= 2;
+            }
+            archive->members = calloc(archive->capacity, sizeof(ArchiveMember));
+            if (archive->members == NULL) {
+                break;
+            }
+        }
+        size_t offset = 0;
+        const char *long_name = NULL; // Name of the next member from an 'L' or 'x' record
+        size_t long_name_length = 0;
+        while (offset + TAR_BLOCK_SIZE <= length) {
+            const unsigned char *header = data + offset;
+            if (header[0] == '\0' || !tarChecksumValid(header)) {
+                break; // End-of-archive marker (or not a tar archive at all)
+            }
+            long long size = parseTarNumber((const char *)header + 124, 12);
+            long long mtime = parseTarNumber((const char *)header + 136, 12);
+            size_t contents = offset + TAR_BLOCK_SIZE;
+            if (size < 0 || (size_t)size > length - contents) {
+                break;
+            }
+            offset = contents + ((size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE) * TAR_BLOCK_SIZE;
+
+            char type = header[156];
+            if (type == 'L') {
+                long_name = (const char *)data + contents;
+                long_name_length = strnlen(long_name, size);
+                continue;
+            }
+            if (type == 'x') {
+                findPaxPath((const char *)data + contents, size, &long_name, &long_name_length);
+                continue;
+            }
+            if (type == 'K' || type == 'g') {
+                continue; // A long link target or archive-wide pax settings, not a member
+            }
+            // Any other header consumes the long name, whether it is served or not
+            const char *member_name = long_name;
+            size_t member_name_length = long_name_length;
+            long_name = NULL;
+            if (type != '0' && type != '\0') {
+                continue;
+            }
+            if (member_name != NULL && member_name_length + 2 > TAR_MAX_NAME) {
+                continue; // The truncated name in the header would be the wrong path
+            }
+            if (pass == 0) {
+                member_count++;
+                continue;
+            }
+            char name[TAR_MAX_NAME];
+            if (member_name != NULL) {
+                snprintf(name, sizeof(name), "/%.*s", (int)member_name_length, member_name);
+            } else {
+                const char *prefix = memcmp(header + 257, "ustar", 5) == 0 ? (const char *)header + 345 : "";
+                int prefix_length = strnlen(prefix, 155);
+                snprintf(name, sizeof(name), "/%.*s%s%.*s", prefix_length, prefix, prefix_length > 0 ? "/" : "",
+                         (int)strnlen((const char *)header, 100), (const char *)header);
+            }
+            const char *request_path = strncmp(name, "/./", 3) == 0 ? name + 2 : name;
+
+            uint64_t hash = hashString(request_path);
+            ArchiveMember *member = findArchiveSlot(archive, hash, request_path);
+            if (member->hash == 0) {
+                member->path = strdup(request_path);
+                if (member->path == NULL) {
+                    continue;
+                }
+                member->hash = hash;
+                archive->count++;
+            }
+            // A later copy of a member replaces an earlier one, as when extracting
+            member->offset = contents;
+            member->size = size;
+            member->mtime = mtime > 0 ? mtime : archive_stat.st_mtime;
+        }
+    }
+    munmap((void *)data, length);
+    if (archive->members == NULL) {
+        close(fd);
+        return -1;
+    }
+    archive->fd = fd;
+    return 0;
+}
+
+/**
+ * @brief Find the archive member served at a request path.
+ *
+ * A directory path is served by its index.html, so "/docs" and "/docs/" find
+ * "/docs/index.html".
+ *
+ * @return The member, or NULL if the archive has none for path.
+ */
+ArchiveMember *findArchiveMember(SiteArchive *archive, const char *path) {
+    if (archive->fd == -1) {
+        return NULL;
+    }
+    ArchiveMember *member = findArchiveSlot(archive, hashString(path), path);
+    if (member->hash != 0) {
+        return member;
+    }
+    char index_path[TAR_MAX_NAME];
+    size_t path_length = strlen(path);
+    while (path_length > 0 && path[path_length - 1] == '/') {
+        path_length--;
+    }
+    if (snprintf(index_path, sizeof(index_path), "%.*s/index.html", (int)path_length, path) >= (int)sizeof(index_path)) {
+        return NULL;
+    }
+    member = findArchiveSlot(archive, hashString(index_path), index_path);
+    return member->hash != 0 ? member : NULL;
+}
+
+/**
+ * @brief Send an archive member: the header, then the contents straight from the archive.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param request The request being answered.
+ * @param member The member to send.
+ * @param head_only Send only the header block, for HEAD requests.
+ * @param content_length Receives the size of the body that was sent.
+ * @return The HTTP status code of the response.
+ */
+int sendArchiveMember(int client_socket, HttpRequest *request, const ArchiveMember *member, int head_only,
+                      size_t *content_length) {
+    HttpResponse response = {0};
+    describeStaticFile(request, NULL, member->path, &response, member->size, member->mtime);
+    int send_body = !response.omit_body && !head_only;
+    response.omit_body = 1; // The body goes out with sendfile(), not through the header buffer
+    long header_length;
+    char *header = HttpResponseToString(&response, &header_length);
+    if (header == NULL) {
+        return sendStatusResponse(client_socket, 500);
+    }
+    ssize_t sent = send(client_socket, header, header_length, send_body ? MSG_MORE : 0);
+    countBytesSent(sent);
+    free(header);
+
+    off_t offset = member->offset;
+    size_t remaining = send_body && sent == header_length ? member->size : 0;
+    while (remaining > 0) {
+        // Bounded chunks keep the connection table's byte count moving on large members
+        ssize_t written = sendfile(client_socket, siteArchive.fd, &offset,
+                                   remaining < SENDFILE_CHUNK ? remaining : SENDFILE_CHUNK);
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error sending %s: %s\n", member->path, written == -1 ? strerror(errno) : "archive truncated");
+            break;
+        }
+        countBytesSent(written);
+        remaining -= written;
+    }
+    *content_length = send_body ? member->size - remaining : 0;
+    return response.status_code;
+}
+
+/**
+ * @brief Tell whether a GET may be preceded by 103 Early Hints.
+ *
+ * HTTP/1.0 clients cannot handle interim responses. A request with If-None-Match is
+ * most likely answered 304 from the browser's cache, which then has the subresources
+ * already.
+ */
+int wantsEarlyHints(const HttpRequest *request) {
+    return serverOptions.early_hints && strcmp(request->version, "HTTP/1.1") == 0 &&
+           getHeader(request, "If-None-Match") == NULL;
+}
+
+/**
+ * @brief Send a page's prebuilt 103 Early Hints response right away.
+ *
+ * @return 0 on success, -1 if the client could not be written to.
+ */
+int sendEarlyHints(int client_socket, const ScannedPage *page) {
+    size_t length = strlen(page->early_hints);
+    ssize_t sent = send(client_socket, page->early_hints, length, 0);
+    countBytesSent(sent);
+    if (sent != (ssize_t)length) {
+        fprintf(stderr, "Error sending early hints: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle an HTTP GET request and send an appropriate response.
+ *
+ * This function processes an HTTP GET request, attempts to match the request path to configured routes,
+ * and sends a corresponding HTTP response. If a matching route is found, it reads the content from
+ * the specified file and sends a "200 OK" response with the content. If no matching route is found,
+ * it sends a "404 Not Found" response.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param request Pointer to the HttpRequest structure representing the request.
+ * @param content_length Receives the size of the response body that was sent.
+ * @return The HTTP status code of the response.
+ */
+int handleGetRequest(int client_socket, HttpRequest *request, size_t *content_length) {
+    HttpResponse response = {0};
+    long size = 0;
+    char *uncached_content = NULL;
+    FileCacheHandle cached;
+    memset(&cached, 0, sizeof(cached));
+    response.status_code = 404;
+    strcpy(response.status_message, "Not Found");
+    response.content_length = size;
+    response.content = "";
+
+    const ListenerPolicy *policy = request->policy;
+    const RouteMapping *route = matchRequestRoute(request, 0);
+    ScannedPage *page = NULL;
+    time_t mtime = 0;
+    if (route != NULL && route->callback == NULL) {
+        // A cached page whose scan is known gets its hints before anything is pinned or read,
+        // so the browser starts on the stylesheets and scripts while the page is assembled
+        int hints_sent = 0;
+        size_t known_size;
+        time_t known_mtime;
+        if (wantsEarlyHints(request) && fileCachePeek(&fileCache, route->link, &known_size, &known_mtime) == 0) {
+            ScannedPage *known = findPageScan(route->link, NULL, known_size, known_mtime);
+            if (known != NULL && known->early_hints != NULL) {
+                if (sendEarlyHints(client_socket, known) == -1) {
+                    return 0;
+                }
+                hints_sent = 1;
+            }
+        }
+        const char *content = NULL;
+        if (fileCacheAcquire(&fileCache, route->link, &cached) != -1) {
+            content = cached.data;
+            size = cached.size;
+            mtime = cached.mtime;
+        } else {
+            // Not cacheable right now, read it straight from disk
+            struct stat file_stat;
+            if (stat(route->link, &file_stat) == 0) {
+                mtime = file_stat.st_mtime;
+            }
+            content = uncached_content = loadAssetFile(route->link, &size);
+        }
+        if (content != NULL) {
+            ScannedPage *scan = findPageScan(route->link, content, size, mtime);
+            page = scan != NULL && scan->segment_count > 0 ? scan : NULL;
+            response.content = content;
+            describeStaticFile(request, route, route->link, &response, size, mtime);
+            if (!hints_sent && scan != NULL && scan->early_hints != NULL && response.status_code == 200 &&
+                wantsEarlyHints(request) && sendEarlyHints(client_socket, scan) == -1) {
+                free(uncached_content);
+                fileCacheRelease(&cached);
+                return 0;
+            }
+        } else {
+            // Handle file read error, e.g., by sending a 500 Internal Server Error response
+            response.status_code = 500;
+            strcpy(response.status_message, "Internal Server Error");
+        }
+    }
+
+    if (route != NULL && route->callback != NULL) {
+        return route->callback(client_socket, request, content_length);
+    }
+    int unrouted_file = route == NULL && policy->serve_static_files;
+    Template *template = unrouted_file ? findTemplate(request->path) : NULL;
+    if (template != NULL) {
+        return sendTemplate(client_socket, template, request, content_length);
+    }
+    ArchiveMember *member = unrouted_file ? findArchiveMember(&siteArchive, request->path) : NULL;
+    if (member != NULL) {
+        return sendArchiveMember(client_socket, request, member, 0, content_length);
+    }
+
+    int status_code;
+    if (page != NULL) {
+        status_code = sendIncludePage(client_socket, request, route, page, response.content, mtime, content_length);
+    } else {
+        *content_length = response.omit_body ? 0 : response.content_length;
+        status_code = sendHttpResponse(client_socket, &response);
+    }
+    free(uncached_content); // Free content memory
+    fileCacheRelease(&cached);
+    return status_code;
+}
+
+/**
+ * @brief Handle an HTTP HEAD request without reading the file it describes.
+ *
+ * The size and mtime come from the cache index when the file is cached and from
+ * stat() otherwise; either way the headers match what a GET would send, but the
+ * contents are never read, pinned or sent. When the served size depends on contents
+ * this process has not loaded yet (a minified file, or a page it has not scanned for
+ * includes), Content-Length and ETag are left out instead. Routes with a callback run
+ * it, and the callback leaves the body out; templates are rendered to learn their length.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param request Pointer to the HttpRequest structure representing the request.
+ * @return The HTTP status code of the response.
+ */
+int handleHeadRequest(int client_socket, HttpRequest *request) {
+    HttpResponse response = {0};
+    response.status_code = 404;
+    strcpy(response.status_message, "Not Found");
+    response.content = "";
+    response.omit_body = 1;
+
+    const ListenerPolicy *policy = request->policy;
+    const RouteMapping *route = matchRequestRoute(request, 0);
+    if (route != NULL && route->callback != NULL) {
+        // Callbacks see the method and leave the body out themselves
+        size_t content_length;
+        return route->callback(client_socket, request, &content_length);
+    }
+    int unrouted_file = route == NULL && policy->serve_static_files;
+    Template *template = unrouted_file ? findTemplate(request->path) : NULL;
+    if (template != NULL) {
+        size_t content_length;
+        return sendTemplate(client_socket, template, request, &content_length);
+    }
+    ArchiveMember *member = unrouted_file ? findArchiveMember(&siteArchive, request->path) : NULL;
+    if (member != NULL) {
+        size_t content_length;
+        return sendArchiveMember(client_socket, request, member, 1, &content_length);
+    }
+    if (route != NULL && route->link != NULL) {
+        size_t size;
+        time_t mtime;
+        int found = fileCachePeek(&fileCache, route->link, &size, &mtime) == 0 ? 0 :
+                    statAssetFile(route->link, &size, &mtime);
+        if (found != -1) {
+            // A page this process has not scanned yet may have includes that change its size
+            int size_known = found == 0 && (!mayContainIncludes(route->link) || pageScanKnown(route->link, size, mtime));
+            ScannedPage *page = size_known ? findPageIncludes(route->link, NULL, size, mtime) : NULL;
+            if (page != NULL && describeIncludePage(page, &size, &mtime) == -1) {
+                size_known = 0;
+            }
+            describeStaticFile(request, route, route->link, &response, size, mtime);
+            if (!size_known) {
+                // Rather than read the body to measure it, leave out what depends on its size
+                response.status_code = 200;
+                strcpy(response.status_message, "OK");
+                response.etag[0] = '\0';
+                response.length_unknown = 1;
+            }
+        } else {
+            response.status_code = 500;
+            strcpy(response.status_message, "Internal Server Error");
+        }
+    }
+    return sendHttpResponse(client_socket, &response);
+}
+
+/**
+ * @brief Receive the body of a request for a route that accepts one.
+ *
+ * Everything that can be decided from the headers is decided before a single body
+ * byte is read: an unknown expectation (417), a Content-Length over the route's limit
+ * (413), a Transfer-Encoding we cannot read (411) and the route's own accept_body
+ * check. Only then, if the client sent "Expect: 100-continue" and is waiting for the
+ * go-ahead, is the interim 100 Continue response sent. A rejected client never uploads
+ * the body, and an accepted one does not sit out its expectation timeout. HTTP/1.0
+ * clients cannot wait for a 100, so their Expect header is ignored.
+ *
+ * The body is stored in the request arena when it fits, on the heap otherwise (then
+ * body_allocated is set and the caller frees it).
+ *
+ * @param client_socket The socket connected to the client.
+ * @param request The request; body and body_size describe the complete body on success.
+ * @param route The route the request is for.
+ * @return 0 on success, or the status code to reject the request with.
+ */
+int receiveRequestBody(int client_socket, HttpRequest *request, const RouteMapping *route) {
+    size_t limit = route->max_body_size != 0 ? route->max_body_size : (size_t)request->policy->max_body_size;
+    const char *expect = strcmp(request->version, "HTTP/1.0") != 0 ? getHeader(request, "Expect") : NULL;
+    if (expect != NULL && strcasecmp(expect, "100-continue") != 0) {
+        return 417;
+    }
+    if (getHeader(request, "Transfer-Encoding") != NULL) {
+        return 411;
+    }
+    if (request->content_length > limit) {
+        return 413;
+    }
+    if (route->accept_body != NULL) {
+        int status_code = route->accept_body(request);
+        if (status_code != 0) {
+            return status_code;
+        }
+    }
+
+    size_t received = request->body_size < request->content_length ? request->body_size : request->content_length;
+    char *body = arenaAllocate(request->arena, request->content_length + 1);
+    if (body == NULL) {
+        body = malloc(request->content_length + 1);
+        if (body == NULL) {
+            return 500;
+        }
+        request->body_allocated = 1;
+    }
+    if (received > 0) {
+        memmove(body, request->body, received);
+    }
+    request->body = body;
+
+    if (expect != NULL && received == 0 && request->content_length > 0) {
+        static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        ssize_t sent = send(client_socket, interim, sizeof(interim) - 1, 0);
+        if (sent == -1) {
+            return 400;
+        }
+        countBytesSent(sent);
+    }
+    size_t buffered = received;
+    if (received < request->content_length) {
+        updateConnectionSlot(CONNECTION_READING_BODY, 0);
+    }
+    while (received < request->content_length) {
+        ssize_t bytes_received = recv(client_socket, body + received, request->content_length - received, 0);
+        if (bytes_received <= 0) {
+            return 400;
+        }
+        received += bytes_received;
+    }
+    if (received > buffered) {
+        updateConnectionSlot(CONNECTION_WRITING, received - buffered);
+    }
+    body[received] = '\0';
+    request->body_size = received;
+    return 0;
+}
+
+/**
+ * @brief Throw away the rest of a rejected request's body before the socket is closed.
+ *
+ * A client that did not wait for 100 Continue is already sending the body, and closing
+ * a socket with unread data makes the kernel answer with a reset that can destroy the
+ * response before the client has read it. The write side is shut down first so the
+ * client sees the response end, then input is discarded until the body is complete,
+ * the client closes, DISCARD_MAX_BYTES have been read or DISCARD_TIMEOUT_MS have passed.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param unread Body bytes still to come (SIZE_MAX if the length is not known).
+ */
+void discardRequestBody(int client_socket, size_t unread) {
+    shutdown(client_socket, SHUT_WR);
+    struct timespec start;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char scratch[4096];
+    size_t discarded = 0;
+    while (discarded < unread && discarded < DISCARD_MAX_BYTES) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining_ms = DISCARD_TIMEOUT_MS - ((now.tv_sec - start.tv_sec) * 1000L +
+                                                  (now.tv_nsec - start.tv_nsec) / 1000000);
+        struct pollfd readable = {client_socket, POLLIN, 0};
+        if (remaining_ms <= 0 || poll(&readable, 1, remaining_ms) <= 0) {
+            break;
+        }
+        ssize_t bytes_received = recv(client_socket, scratch, sizeof(scratch), 0);
+        if (bytes_received <= 0) {
+            break;
+        }
+        discarded += bytes_received;
+    }
+}
+
+/**
+ * @brief Handle an HTTP POST request: receive its body and pass it to the route's callback.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param request Pointer to the HttpRequest structure representing the request.
+ * @param content_length Receives the size of the response body that was sent.
+ * @return The HTTP status code of the response.
+ */
+int handlePostRequest(int client_socket, HttpRequest *request, size_t *content_length) {
+    const RouteMapping *route = matchRequestRoute(request, 1);
+    int status_code = route == NULL || route->callback == NULL ? 404 : receiveRequestBody(client_socket, request, route);
+    if (status_code != 0) {
+        status_code = sendStatusResponse(client_socket, status_code);
+        if (getHeader(request, "Transfer-Encoding") != NULL) {
+            discardRequestBody(client_socket, SIZE_MAX);
+        } else if (request->content_length > request->body_size) {
+            discardRequestBody(client_socket, request->content_length - request->body_size);
+        }
+        return status_code;
+    }
+    return route->callback(client_socket, request, content_length);
+}
+
+/**
+ * @brief Callback for the POST /echo route: answer with the request body.
+ */
+int handleEchoRequest(int client_socket, HttpRequest *request, size_t *content_length) {
+    HttpResponse response = {0};
+    response.status_code = 200;
+    strcpy(response.status_message, "OK");
+    response.content_length = request->body_size;
+    response.content = request->body != NULL ? request->body : "";
+    *content_length = response.content_length;
+    return sendHttpResponse(client_socket, &response);
+}
+
+/**
+ * @brief Send a plain text response built in the request arena; a HEAD request gets the headers only.
+ *
+ * @return The HTTP status code of the response.
+ */
+int sendTextResponse(int client_socket, const HttpRequest *request, const char *text, size_t length,
+                     size_t *content_length) {
+    HttpResponse response = {0};
+    response.status_code = 200;
+    strcpy(response.status_message, "OK");
+    response.content_type = "text/plain; version=0.0.4; charset=utf-8";
+    response.content = text;
+    response.content_length = length;
+    response.omit_body = isHeadRequest(request);
+    *content_length = response.omit_body ? 0 : length;
+    return sendHttpResponse(client_socket, &response);
+}
+
+/**
+ * @brief Admin callback for GET /metrics: the file cache counters in Prometheus text format.
+ *
+ * The counters live in the shared cache region, so any worker reports the totals of all.
+ */
+int handleMetricsRequest(int client_socket, HttpRequest *request, size_t *content_length) {
+    char *text = arenaAllocate(request->arena, ADMIN_RESPONSE_SIZE);
+    if (text == NULL) {
+        return sendStatusResponse(client_socket, 500);
+    }
+    size_t length = 0;
+    if (fileCache.index != NULL) {
+        FileCacheStats *stats = &fileCache.index->stats;
+        const struct {
+            const char *name;
+            size_t value;
+        } counters[] = {
+            {"http_file_cache_hits_total", atomic_load(&stats->hits)},
+            {"http_file_cache_misses_total", atomic_load(&stats->misses)},
+            {"http_file_cache_admissions_total", atomic_load(&stats->admissions)},
+            {"http_file_cache_rejections_total", atomic_load(&stats->rejections)},
+            {"http_file_cache_evictions_total", atomic_load(&stats->evictions)},
+        };
+        for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]) && length < ADMIN_RESPONSE_SIZE; i++) {
+            length += snprintf(text + length, ADMIN_RESPONSE_SIZE - length, "# TYPE %s counter\n%s %zu\n",
+                               counters[i].name, counters[i].name, counters[i].value);
+        }
+    }
+    if (length < ADMIN_RESPONSE_SIZE) {
+        length += snprintf(text + length, ADMIN_RESPONSE_SIZE - length, "# TYPE http_workers gauge\nhttp_workers %d\n",
+                           serverOptions.workers > 0 ? serverOptions.workers : 1);
+    }
+    return sendTextResponse(client_socket, request, text, length < ADMIN_RESPONSE_SIZE ? length : ADMIN_RESPONSE_SIZE - 1,
+                            content_length);
+}
+
+/**
+ * @brief Admin callback for GET /debug/listeners: each listener with its policy and limits.
+ */
+int handleListenersRequest(int client_socket, HttpRequest *request, size_t *content_length) {
+    char *text = arenaAllocate(request->arena, ADMIN_RESPONSE_SIZE);
+    if (text == NULL) {
+        return sendStatusResponse(client_socket, 500);
+    }
+    size_t length = 0;
+    for (int i = 0; i < listenerCount && length < ADMIN_RESPONSE_SIZE; i++) {
+        const ListenerPolicy *policy = listeners[i].policy;
+        length += snprintf(text + length, ADMIN_RESPONSE_SIZE - length,
+                           "%s policy=%s routes=%zu uri=%d header=%d headers=%d body=%d log=%d\n",
+                           listeners[i].spec, policy->name, policy->get_route_count + policy->post_route_count,
+                           policy->max_uri_length, policy->max_header_size, policy->max_headers,
+                           policy->max_body_size, (int)policy->log_level);
+    }
+    return sendTextResponse(client_socket, request, text, length < ADMIN_RESPONSE_SIZE ? length : ADMIN_RESPONSE_SIZE - 1,
+                            content_length);
+}
+
+/**
+ * @brief Handle an HTTP request and route it based on the request method.
+ *
+ * This function dispatches the HTTP request to specific handling functions based on the request method.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param request Pointer to the HttpRequest structure representing the request.
+ * @param content_length Receives the size of the response body that was sent.
+ * @return The HTTP status code of the response, or 0 if no response was sent.
+ */
+int handleHttpRequest(int client_socket, HttpRequest* request, size_t *content_length) {
+    *content_length = 0;
+    if (strcmp(request->method, "GET") == 0) {
+        return handleGetRequest(client_socket, request, content_length);
+    } else if (strcmp(request->method, "HEAD") == 0) {
+        return handleHeadRequest(client_socket, request);
+    } else if (strcmp(request->method, "POST") == 0) {
+        return handlePostRequest(client_socket, request, content_length);
+    } else {
+        // Handle unsupported methods or other errors here
+        fprintf(stderr, "Unsupported HTTP method: %s\n", request->method);
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief File descriptor of the access log, or -1 when access logging is off.
+ *
+ * The log is opened with O_APPEND before any worker is forked and every line is written
+ * with a single write(), so lines from different workers never interleave.
+ */
+int accessLogFd = -1;
+
+/**
+ * @brief Open the access log for appending.
+ *
+ * @param path The log file, created if it does not exist.
+ * @return 0 on success, -1 on failure.
+ */
+int openAccessLog(const char *path) {
+    accessLogFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (accessLogFd == -1) {
+        fprintf(stderr, "Error opening access log %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Format a client address for the log: the IP address, or "unix" for a Unix socket peer.
+ */
+void formatClientAddress(const struct sockaddr_storage *address, char *buffer, size_t size) {
+    snprintf(buffer, size, "-");
+    if (address->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)address)->sin_addr, buffer, size);
+    } else if (address->ss_family == AF_INET6) {
+        const struct in6_addr *ip = &((const struct sockaddr_in6 *)address)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(ip)) {
+            // IPv4 clients of a dual-stack listener are logged as plain IPv4 addresses
+            inet_ntop(AF_INET, &ip->s6_addr[12], buffer, size);
+        } else {
+            inet_ntop(AF_INET6, ip, buffer, size);
+        }
+    } else if (address->ss_family == AF_UNIX) {
+        snprintf(buffer, size, "unix");
+    }
+}
+
+/**
+ * @brief Escape a request field for the quoted part of an access log line.
+ *
+ * '"' and '\\' get a backslash and bytes outside printable ASCII become \\xNN, so a
+ * crafted request line can neither end the quoted field early nor start a new line.
+ *
+ * @param text The field.
+ * @param allocated Receives the escaped copy to free, or NULL if text was used as it is.
+ * @return The text to log, or NULL if out of memory.
+ */
+const char *escapeLogField(const char *text, char **allocated) {
+    *allocated = NULL;
+    size_t length = 0;
+    size_t escaped_length = 0;
+    for (; text[length] != '\0'; length++) {
+        unsigned char c = text[length];
+        escaped_length += c == '"' || c == '\\' ? 2 : (c < 0x20 || c >= 0x7f ? 4 : 1);
+    }
+    if (escaped_length == length) {
+        return text;
+    }
+    char *escaped = malloc(escaped_length + 1);
+    if (escaped == NULL) {
+        return NULL;
+    }
+    char *out = escaped;
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            *out++ = '\\';
+            *out++ = *c;
+        } else if (*c < 0x20 || *c >= 0x7f) {
+            out += sprintf(out, "\\x%02x", *c);
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+    *allocated = escaped;
+    return escaped;
+}
+
+/**
+ * @brief Append one request to the access log in Common Log Format, followed by the request id.
+ *
+ * @param client_address The address of the client.
+ * @param request The request that was answered.
+ * @param status_code The status code sent (0 if no response was sent).
+ * @param content_length The size of the response body.
+ */
+void writeAccessLog(const struct sockaddr_storage *client_address, const HttpRequest *request,
+                    int status_code, size_t content_length) {
+    if (accessLogFd == -1) {
+        return;
+    }
+
+    char ip[INET6_ADDRSTRLEN];
+    formatClientAddress(client_address, ip, sizeof(ip));
+    char timestamp[32];
+    time_t now = time(NULL);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    strftime(timestamp, sizeof(timestamp), "%d/%b/%Y:%H:%M:%S +0000", &utc);
+    char status[12] = "-";
+    if (status_code > 0) {
+        snprintf(status, sizeof(status), "%d", status_code);
+    }
+
+    // Requests that failed to parse may lack any of these
+    char *escaped[3];
+    const char *method = escapeLogField(request->method != NULL ? request->method : "-", &escaped[0]);
+    const char *path = escapeLogField(request->target != NULL ? request->target : "-", &escaped[1]);
+    const char *version = escapeLogField(request->version != NULL ? request->version : "-", &escaped[2]);
+
+    // Long URLs do not fit the stack buffer; format those a second time into a heap one
+    char stack_line[512];
+    char *line = stack_line;
+    int length = -1;
+    if (method != NULL && path != NULL && version != NULL) {
+        length = snprintf(line, sizeof(stack_line), "%s - - [%s] \"%s %s %s\" %s %zu %s\n",
+                          ip, timestamp, method, path, version, status, content_length, tracedConnection.id_text);
+    }
+    if (length >= (int)sizeof(stack_line)) {
+        line = malloc(length + 1);
+        if (line != NULL) {
+            snprintf(line, length + 1, "%s - - [%s] \"%s %s %s\" %s %zu %s\n",
+                     ip, timestamp, method, path, version, status, content_length, tracedConnection.id_text);
+        }
+    }
+    if (line != NULL && length > 0 && write(accessLogFd, line, length) == -1) {
+        fprintf(stderr, "Error writing access log: %s\n", strerror(errno));
+    }
+    if (line != stack_line) {
+        free(line);
+    }
+    for (int i = 0; i < 3; i++) {
+        free(escaped[i]);
+    }
+}
+
+
+/**
+ * @brief Receive bytes until the request's header block is complete.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param buffer Where the bytes are received; must hold limit + 1 bytes.
+ * @param limit Maximum size of the header block.
+ * @param received Receives the number of bytes read (header block and any body bytes after it).
+ * @return The length of the header block (> 0), 0 if the client went away, or the
+ *         negated status code to reject the request with (-414 or -431).
+ */
+long receiveRequestHeaders(int client_socket, char *buffer, size_t limit, size_t *received) {
+    *received = 0;
+    while (1) {
+        if (*received >= limit) {
+            // Without even a complete request line, the URL is what is too long
+            return memchr(buffer, '\n', *received) != NULL ? -431 : -414;
+        }
+        ssize_t bytes_received = recv(client_socket, buffer + *received, limit - *received, 0);
+        if (bytes_received <= 0) {
+            if (bytes_received == -1) {
+                fprintf(stderr, "Error receiving data: %s\n", strerror(errno));
+            }
+            return 0;
+        }
+
+        // The blank line may straddle the previous read
+        size_t search_from = *received > 3 ? *received - 3 : 0;
+        *received += bytes_received;
+        buffer[*received] = '\0';
+        char *blank_line = memmem(buffer + search_from, *received - search_from, "\r\n\r\n", 4);
+        if (blank_line != NULL) {
+            return blank_line + 4 - buffer;
+        }
+    }
+}
+
+//------------------------------------------------------------------
+#define HEALTH_CHECK_PATH "/healthz"
+#define LOAD_WINDOW_NSEC 1000000000L
+
+/**
+ * @brief How busy this worker has been recently, for the health check.
+ *
+ * load is a moving average of the share of time the worker spent handling connections
+ * rather than waiting for them. Every interval is folded in with a weight proportional
+ * to its length, so the average follows about the last LOAD_WINDOW_NSEC of wall time
+ * no matter how many connections that covered.
+ */
+typedef struct {
+    struct timespec since; ///< End of the last interval folded into load.
+    double load;           ///< Recent busy share, 0 (idle) to 1 (saturated).
+} WorkerLoad;
+
+WorkerLoad workerLoad;
+
+/**
+ * @brief Fold the time since the last call into the worker's load.
+ *
+ * @param busy Whether the worker was handling a connection (1) or waiting for one (0).
+ * @return The length of the interval in nanoseconds.
+ */
+long chargeWorkerTime(int busy) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - workerLoad.since.tv_sec) * 1000000000L +
+                   (now.tv_nsec - workerLoad.since.tv_nsec);
+    double weight = elapsed >= LOAD_WINDOW_NSEC ? 1.0 : (double)elapsed / LOAD_WINDOW_NSEC;
+    workerLoad.load += ((busy ? 1.0 : 0.0) - workerLoad.load) * weight;
+    workerLoad.since = now;
+    return elapsed;
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief The mapped metrics file, or NULL when --metrics-file is not given.
+ */
+MetricsSegment *metricsSegment = NULL;
+
+/**
+ * @brief This worker's slot in metricsSegment, or NULL when metrics are off.
+ */
+WorkerMetrics *workerMetrics = NULL;
+
+/**
+ * @brief Add to a counter of this worker's slot.
+ *
+ * The worker is the only writer of its slot, so a relaxed load and store is enough and
+ * avoids the locked read-modify-write of atomic_fetch_add.
+ */
+static inline void addMetric(_Atomic uint64_t *counter, uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+/**
+ * @brief Create the metrics file and map it shared, before any worker is forked.
+ *
+ * An existing file is truncated, so a server restart starts from zero.
+ *
+ * @param path The metrics file.
+ * @param worker_count Number of worker slots.
+ * @return 0 on success, -1 on failure.
+ */
+int openMetricsFile(const char *path, int worker_count) {
+    size_t size = offsetof(MetricsSegment, workers) + worker_count * sizeof(WorkerMetrics);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        fprintf(stderr, "Error creating metrics file %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Error mapping metrics file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    metricsSegment = memory;
+    MetricsHeader *header = &metricsSegment->header;
+    header->version = METRICS_VERSION;
+    header->header_size = offsetof(MetricsSegment, workers);
+    header->worker_size = sizeof(WorkerMetrics);
+    header->worker_count = worker_count;
+    header->master_pid = getpid();
+    header->started_at = time(NULL);
+    atomic_store_explicit(&header->magic, METRICS_MAGIC, memory_order_release);
+    return 0;
+}
+
+/**
+ * @brief Claim this worker's slot in the metrics file.
+ *
+ * A restarted worker takes over the slot of the one it replaces, so the counters keep
+ * growing across restarts.
+ */
+void attachWorkerMetrics(void) {
+    if (metricsSegment != NULL) {
+        workerMetrics = &metricsSegment->workers[workerId];
+        atomic_store_explicit(&workerMetrics->pid, getpid(), memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Record a handled connection: its duration, the worker's load and, about once a
+ *        second, the file cache counters.
+ *
+ * @param elapsed Nanoseconds from accept to close.
+ */
+void recordConnectionMetrics(long elapsed) {
+    if (workerMetrics == NULL) {
+        return;
+    }
+    long usec = elapsed / 1000;
+    int bucket = usec > 0 ? 64 - __builtin_clzl(usec) : 0;
+    if (bucket >= METRICS_LATENCY_BUCKETS) {
+        bucket = METRICS_LATENCY_BUCKETS - 1;
+    }
+    addMetric(&workerMetrics->latency[bucket], 1);
+    addMetric(&workerMetrics->busy_nsec, elapsed);
+    atomic_store_explicit(&workerMetrics->load_permille, (uint64_t)(workerLoad.load * 1000),
+                          memory_order_relaxed);
+
+    static time_t mirrored_at = 0;
+    if (fileCache.index != NULL && workerLoad.since.tv_sec != mirrored_at) {
+        mirrored_at = workerLoad.since.tv_sec;
+        const FileCacheStats *stats = &fileCache.index->stats;
+        CacheMetrics *cache = &metricsSegment->header.cache;
+        atomic_store_explicit(&cache->hits, atomic_load(&stats->hits), memory_order_relaxed);
+        atomic_store_explicit(&cache->misses, atomic_load(&stats->misses), memory_order_relaxed);
+        atomic_store_explicit(&cache->admissions, atomic_load(&stats->admissions), memory_order_relaxed);
+        atomic_store_explicit(&cache->rejections, atomic_load(&stats->rejections), memory_order_relaxed);
+        atomic_store_explicit(&cache->evictions, atomic_load(&stats->evictions), memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief A response whose bytes are fixed at compile time.
+ */
+typedef struct {
+    const char *text;     ///< Status line, headers and body.
+    size_t length;        ///< Length of text.
+    size_t header_length; ///< Length of the status line and headers, sent alone for HEAD.
+} PrebuiltResponse;
+
+#define PREBUILT_RESPONSE(head, body) {head "\r\n" body, sizeof(head "\r\n" body) - 1, sizeof(head "\r\n") - 1}
+#define HEALTH_HEADERS "Content-Type: text/plain\r\nCache-Control: no-store\r\nConnection: close\r\n"
+
+static const PrebuiltResponse healthyResponse =
+    PREBUILT_RESPONSE("HTTP/1.1 200 OK\r\n" HEALTH_HEADERS "Content-Length: 3\r\n", "ok\n");
+static const PrebuiltResponse degradedResponse =
+    PREBUILT_RESPONSE("HTTP/1.1 503 Service Unavailable\r\n" HEALTH_HEADERS "Retry-After: 1\r\nContent-Length: 9\r\n",
+                      "degraded\n");
+
+/**
+ * @brief Answer a health check without parsing, routing or logging the request.
+ *
+ * Load balancers poll this many times a second, so only the request line is looked at
+ * and the answer is one of two prebuilt responses: 200 normally, 503 while the worker's
+ * recent busy share is at or above --degraded-load.
+ *
+ * @param client_socket The socket connected to the client.
+ * @param buffer The received request headers.
+ * @param header_length Length of the request headers.
+ * @return The status code sent (200 or 503) if the request was a health check, 0 otherwise.
+ */
+int answerHealthCheck(int client_socket, const char *buffer, size_t header_length) {
+    static const char get_line[] = "GET " HEALTH_CHECK_PATH " ";
+    static const char head_line[] = "HEAD " HEALTH_CHECK_PATH " ";
+    int head_only;
+    if (header_length > sizeof(get_line) && memcmp(buffer, get_line, sizeof(get_line) - 1) == 0) {
+        head_only = 0;
+    } else if (header_length > sizeof(head_line) && memcmp(buffer, head_line, sizeof(head_line) - 1) == 0) {
+        head_only = 1;
+    } else {
+        return 0;
+    }
+    const PrebuiltResponse *response = &healthyResponse;
+    if (serverOptions.degraded_load > 0 && workerLoad.load * 100 >= serverOptions.degraded_load) {
+        response = &degradedResponse;
+    }
+    if (workerMetrics != NULL) {
+        addMetric(&workerMetrics->health_checks, 1);
+    }
+    countBytesSent(send(client_socket, response->text, head_only ? response->header_length : response->length, 0));
+    return response == &healthyResponse ? 200 : 503;
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief Start tracing a newly accepted connection: take the next request id and
+ *        prepare the X-Request-Id header.
+ */
+void beginConnectionTrace(void) {
+    static const char hex_digits[] = "0123456789abcdef";
+    uint64_t epoch = tracedConnection.id >> 32;
+    uint64_t counter = (tracedConnection.id & REQUEST_COUNTER_MASK) + 1;
+    if (counter > REQUEST_COUNTER_MASK) {
+        uint64_t now = (uint32_t)time(NULL);
+        epoch = now > epoch ? now : epoch + 1;
+        counter = 0;
+    }
+    tracedConnection.id = epoch << 32 | (uint64_t)workerId << 24 | counter;
+    tracedConnection.accepted = workerLoad.since;
+    for (int i = 0; i < 16; i++) {
+        tracedConnection.id_text[i] = hex_digits[(tracedConnection.id >> (60 - 4 * i)) & 0xf];
+    }
+    tracedConnection.id_text[16] = '\0';
+    memcpy(tracedConnection.headers, "X-Request-Id: ", 14);
+    memcpy(tracedConnection.headers + 14, tracedConnection.id_text, 16);
+    memcpy(tracedConnection.headers + 30, "\r\n", 3);
+}
+
+/**
+ * @brief Check that a string is count lowercase hex digits and, optionally, not all zeros.
+ */
+int isTraceHex(const char *text, size_t count, int reject_zero) {
+    int nonzero = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!((text[i] >= '0' && text[i] <= '9') || (text[i] >= 'a' && text[i] <= 'f'))) {
+            return 0;
+        }
+        nonzero |= text[i] != '0';
+    }
+    return nonzero || !reject_zero;
+}
+
+/**
+ * @brief Join the W3C trace of the request, if it carries a valid traceparent header.
+ *
+ * The trace id and flags are kept and this request becomes the parent: the traceparent
+ * sent back names the request id as the parent id, so downstream logs can be joined
+ * with ours. A malformed header is ignored, as the Trace Context spec requires.
+ *
+ * @param request The parsed request.
+ */
+void joinRequestTrace(const HttpRequest *request) {
+    // version "-" trace-id "-" parent-id "-" flags, e.g. 00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01
+    const char *value = getHeader(request, "traceparent");
+    if (value == NULL || strlen(value) < 55 || !isTraceHex(value, 2, 0) || strncmp(value, "ff", 2) == 0 ||
+        value[2] != '-' || !isTraceHex(value + 3, 32, 1) || value[35] != '-' || !isTraceHex(value + 36, 16, 1) ||
+        value[52] != '-' || !isTraceHex(value + 53, 2, 0) ||
+        (strncmp(value, "00", 2) == 0 ? value[55] != '\0' : value[55] != '\0' && value[55] != '-')) {
+        return;
+    }
+    snprintf(tracedConnection.headers + 32, sizeof(tracedConnection.headers) - 32,
+             "traceparent: 00-%.32s-%s-%.2s\r\n", value + 3, tracedConnection.id_text, value + 53);
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief Map the shared connection table with a slot per worker, before forking.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int initConnectionTable(int slot_count) {
+    void *memory = mmap(NULL, slot_count * sizeof(ConnectionSlot), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Error mapping connection table: %s\n", strerror(errno));
+        return -1;
+    }
+    connectionTable = memory;
+    connectionTableSize = slot_count;
+    for (int i = 0; i < listenerCount; i++) {
+        tcpStatsPublished |= listeners[i].policy == &adminPolicy;
+    }
+    return 0;
+}
+
+/**
+ * @brief Take this worker's slot in the connection table and mark the worker idle.
+ */
+void claimConnectionSlot(void) {
+    if (connectionTable == NULL || workerId >= connectionTableSize) {
+        return;
+    }
+    connectionSlot = &connectionTable[workerId];
+    ConnectionSlot *slot = beginSlotUpdate();
+    slot->pid = getpid();
+    slot->state = CONNECTION_IDLE;
+    slot->fd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &slot->since);
+    endSlotUpdate(slot);
+}
+
+/**
+ * @brief Record a newly accepted connection in this worker's slot.
+ */
+void openConnectionSlot(int client_socket, const struct sockaddr_storage *client_address) {
+    ConnectionSlot *slot = beginSlotUpdate();
+    if (slot != NULL) {
+        slot->state = CONNECTION_READING_HEADERS;
+        slot->fd = client_socket;
+        slot->request_id = tracedConnection.id;
+        slot->since = tracedConnection.accepted;
+        slot->bytes_received = 0;
+        slot->bytes_sent = 0;
+        memset(&slot->tcp, 0, sizeof(slot->tcp));
+        slot->peer = *client_address;
+        slot->request_line[0] = '\0';
+        endSlotUpdate(slot);
+    }
+}
+
+/**
+ * @brief Record that the request headers are in: their size, the request line and a TCP sample.
+ */
+void recordRequestLine(const char *buffer, size_t received) {
+    TcpStats stats;
+    int sampled = sampleOwnTcpStats(&stats);
+    ConnectionSlot *slot = beginSlotUpdate();
+    if (slot != NULL) {
+        if (sampled) {
+            slot->tcp = stats;
+        }
+        size_t length = strcspn(buffer, "\r\n");
+        if (length >= sizeof(slot->request_line)) {
+            length = sizeof(slot->request_line) - 1;
+        }
+        memcpy(slot->request_line, buffer, length);
+        slot->request_line[length] = '\0';
+        slot->state = CONNECTION_WRITING;
+        slot->bytes_received = received;
+        endSlotUpdate(slot);
+    }
+}
+
+/**
+ * @brief Mark this worker idle after its connection was closed.
+ */
+void closeConnectionSlot(void) {
+    ConnectionSlot *slot = beginSlotUpdate();
+    if (slot != NULL) {
+        slot->state = CONNECTION_IDLE;
+        slot->fd = -1;
+        clock_gettime(CLOCK_MONOTONIC, &slot->since);
+        endSlotUpdate(slot);
+    }
+}
+
+/**
+ * @brief Copy a slot that another worker may be updating.
+ *
+ * @return 1 with a consistent copy, 0 if the slot kept changing.
+ */
+int readConnectionSlot(const ConnectionSlot *slot, ConnectionSlot *copy) {
+    for (int attempt = 0; attempt < 100; attempt++) {
+        uint32_t before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(copy, slot, sizeof(*copy));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == before) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Read TCP_INFO of a connection that may belong to another worker.
+ *
+ * Another worker's socket is duplicated with pidfd_getfd(), which needs Linux 5.6 and
+ * the right to ptrace the worker; where that is refused only the table's own fields are
+ * shown.
+ *
+ * @return 0 on success, -1 if the statistics are not available.
+ */
+int sampleTcpInfo(const ConnectionSlot *slot, struct tcp_info *info) {
+    socklen_t length = sizeof(*info);
+    if (slot->pid == getpid()) {
+        return getsockopt(slot->fd, IPPROTO_TCP, TCP_INFO, info, &length);
+    }
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_getfd)
+    int pidfd = syscall(SYS_pidfd_open, slot->pid, 0);
+    if (pidfd == -1) {
+        return -1;
+    }
+    int fd = syscall(SYS_pidfd_getfd, pidfd, slot->fd, 0);
+    close(pidfd);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = getsockopt(fd, IPPROTO_TCP, TCP_INFO, info, &length);
+    close(fd);
+    return result;
+#else
+    (void)info;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Admin callback for GET /debug/connections: what every worker is doing right now.
+ *
+ * Each worker's slot is copied under its seqlock; for TCP connections the kernel's
+ * TCP_INFO adds round-trip time, retransmissions, congestion window and byte counts. A
+ * live sample is taken where the socket can be reached (tcp=live). The slot is copied
+ * again afterwards and the sample dropped if the worker has moved on to another
+ * connection, since the descriptor may then name a different socket. Otherwise the
+ * sample the worker last published is shown with its age (tcp=published), and if there
+ * is none either, tcp=unavailable says why.
+ */
+int handleConnectionsRequest(int client_socket, HttpRequest *request, size_t *content_length) {
+    size_t size = connectionTableSize * 512 + 1;
+    char *text = malloc(size);
+    if (text == NULL) {
+        return sendStatusResponse(client_socket, 500);
+    }
+    static const char *state_names[] = {"idle", "reading-headers", "reading-body", "writing"};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    size_t length = 0;
+    for (int i = 0; i < connectionTableSize && length < size; i++) {
+        ConnectionSlot slot, check;
+        if (!readConnectionSlot(&connectionTable[i], &slot) || slot.pid == 0) {
+            continue;
+        }
+        double age_ms = (now.tv_sec - slot.since.tv_sec) * 1e3 + (now.tv_nsec - slot.since.tv_nsec) / 1e6;
+        length += snprintf(text + length, size - length, "worker=%d pid=%d state=%s age_ms=%.1f", i, (int)slot.pid,
+                           state_names[slot.state], age_ms);
+        if (slot.state != CONNECTION_IDLE && length < size) {
+            char peer[INET6_ADDRSTRLEN];
+            formatClientAddress(&slot.peer, peer, sizeof(peer));
+            length += snprintf(text + length, size - length, " id=%016llx peer=%s received=%zu sent=%zu",
+                               (unsigned long long)slot.request_id, peer, slot.bytes_received, slot.bytes_sent);
+            if (length < size && slot.peer.ss_family != AF_UNIX) {
+                struct tcp_info info;
+                TcpStats stats = slot.tcp;
+                const char *source = "published";
+                const char *reason = NULL;
+                if (sampleTcpInfo(&slot, &info) == -1) {
+                    reason = errno == EPERM ? "socket of another worker not reachable (ptrace_scope)" : strerror(errno);
+                } else if (!readConnectionSlot(&connectionTable[i], &check) || check.request_id != slot.request_id) {
+                    reason = "connection changed while sampling";
+                } else {
+                    fillTcpStats(&stats, &info, &now);
+                    source = "live";
+                }
+                if (stats.sampled.tv_sec == 0 && stats.sampled.tv_nsec == 0) {
+                    length += snprintf(text + length, size - length, " tcp=unavailable reason=\"%s\"", reason);
+                } else {
+                    double sample_age_ms = (now.tv_sec - stats.sampled.tv_sec) * 1e3 +
+                                           (now.tv_nsec - stats.sampled.tv_nsec) / 1e6;
+                    length += snprintf(text + length, size - length,
+                                       " tcp=%s tcp_age_ms=%.1f rtt_ms=%.3f rttvar_ms=%.3f retrans=%u/%u cwnd=%u"
+                                       " bytes_acked=%llu bytes_received=%llu",
+                                       source, sample_age_ms, stats.rtt_usec / 1e3, stats.rttvar_usec / 1e3,
+                                       stats.retransmits, stats.total_retrans, stats.snd_cwnd,
+                                       (unsigned long long)stats.bytes_acked,
+                                       (unsigned long long)stats.bytes_received);
+                    if (reason != NULL && length < size) {
+                        length += snprintf(text + length, size - length, " live_unavailable=\"%s\"", reason);
+                    }
+                }
+            }
+            if (length < size) {
+                length += snprintf(text + length, size - length, " request=\"%s\"", slot.request_line);
+            }
+        }
+        if (length < size) {
+            length += snprintf(text + length, size - length, "\n");
+        }
+    }
+    int status_code = sendTextResponse(client_socket, request, text, length < size ? length : size - 1, content_length);
+    free(text);
+    return status_code;
+}
+
+/**
+ * @brief Receive a single HTTP request from a client, answer it and close the connection.
+ *
+ * The first max_header_size bytes (per the listener's policy) of the connection buffer
+ * receive the request; the rest serves as the request arena.
+ *
+ * @param client_socket The socket connected to the client. It is closed before returning.
+ * @param listener The listener the connection was accepted on.
+ * @param client_address The address of the client, for the access log.
+ */
+void handleClientConnection(int client_socket, const Listener *listener,
+                            const struct sockaddr_storage *client_address) {
+    const ListenerPolicy *policy = listener->policy;
+    // Receive and process HTTP requests
+    char *buffer = acquireBuffer(&bufferPool);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error allocating connection buffer\n");
+        close(client_socket);
+        return;
+    }
+    size_t limit = policy->max_header_size;
+    RequestArena arena = {buffer + limit + 1, buffer + CONNECTION_BUFFER_SIZE};
+
+    size_t received;
+    long header_length = receiveRequestHeaders(client_socket, buffer, limit, &received);
+    int health_status = header_length > 0 ? answerHealthCheck(client_socket, buffer, header_length) : 0;
+    if (header_length == 0 || health_status != 0) {
+        releaseBuffer(&bufferPool, buffer);
+        close(client_socket);
+        closeConnectionSlot();
+        if (PROBE_ENABLED(connection__close)) {
+            PROBE(connection__close, tracedConnection.id, health_status, nanosecondsSinceAccept());
+        }
+        return;
+    }
+    recordRequestLine(buffer, received);
+    printf("Received Data:\n");
+    printStringWithEscapeChars(buffer);
+
+    HttpRequest http;
+    memset(&http, 0, sizeof(http));
+    size_t content_length = 0;
+    int status_code;
+    if (header_length < 0) {
+        status_code = sendStatusResponse(client_socket, (int)-header_length);
+    } else if ((status_code = parseHttpRequest(buffer, header_length, &http, &arena, policy)) != 0) {
+        sendStatusResponse(client_socket, status_code);
+    } else {
+        joinRequestTrace(&http);
+        if (received > (size_t)header_length) {
+            http.body = buffer + header_length;
+            http.body_size = received - header_length;
+        }
+        if (PROBE_ENABLED(request__parsed)) {
+            PROBE(request__parsed, tracedConnection.id, http.method, http.path, header_length, nanosecondsSinceAccept());
+        }
+        if (PROBE_ENABLED(response__start)) {
+            PROBE(response__start, tracedConnection.id, nanosecondsSinceAccept());
+        }
+        status_code = handleHttpRequest(client_socket, &http, &content_length);
+        if (PROBE_ENABLED(response__done)) {
+            PROBE(response__done, tracedConnection.id, status_code, content_length, nanosecondsSinceAccept());
+        }
+    }
+    if (workerMetrics != NULL) {
+        addMetric(&workerMetrics->responses[status_code >= 100 && status_code < 600 ? status_code / 100 : 0], 1);
+        addMetric(&workerMetrics->bytes_received, (header_length > 0 ? header_length : 0) + http.body_size);
+        addMetric(&workerMetrics->bytes_sent, content_length);
+    }
+    if (policy->log_level == ACCESS_LOG_ALL || (policy->log_level == ACCESS_LOG_ERRORS &&
+                                                (status_code == 0 || status_code >= 400))) {
+        writeAccessLog(client_address, &http, status_code, content_length);
+    }
+
+    // Clean up resources
+    if (http.body_allocated) {
+        free(http.body);
+    }
+    close(client_socket);
+    releaseBuffer(&bufferPool, buffer);
+    closeConnectionSlot();
+    if (PROBE_ENABLED(connection__close)) {
+        PROBE(connection__close, tracedConnection.id, status_code, nanosecondsSinceAccept());
+    }
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief A request path and how often it appeared in a prewarm source.
+ */
+typedef struct {
+    char *path;   ///< The request path (owned).
+    size_t count; ///< Number of requests for the path.
+} PathCount;
+
+/**
+ * @brief Open-addressed table counting request paths.
+ */
+typedef struct {
+    PathCount *slots; ///< Table of capacity slots; empty slots have a NULL path.
+    size_t capacity;  ///< Number of slots (a power of two).
+    size_t used;      ///< Number of distinct paths stored.
+} PathCounter;
+
+/**
+ * @brief Count one occurrence of a path, growing the table when it gets too full.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int countPath(PathCounter *counter, const char *path) {
+    if ((counter->used + 1) * 2 > counter->capacity) {
+        size_t capacity = counter->capacity ? counter->capacity * 2 : 256;
+        PathCount *slots = calloc(capacity, sizeof(PathCount));
+        if (slots == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < counter->capacity; i++) {
+            if (counter->slots[i].path != NULL) {
+                size_t slot = hashString(counter->slots[i].path) & (capacity - 1);
+                while (slots[slot].path != NULL) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                slots[slot] = counter->slots[i];
+            }
+        }
+        free(counter->slots);
+        counter->slots = slots;
+        counter->capacity = capacity;
+    }
+
+    size_t slot = hashString(path) & (counter->capacity - 1);
+    while (counter->slots[slot].path != NULL) {
+        if (strcmp(counter->slots[slot].path, path) == 0) {
+            counter->slots[slot].count++;
+            return 0;
+        }
+        slot = (slot + 1) & (counter->capacity - 1);
+    }
+    counter->slots[slot].path = strdup(path);
+    if (counter->slots[slot].path == NULL) {
+        return -1;
+    }
+    counter->slots[slot].count = 1;
+    counter->used++;
+    return 0;
+}
+
+/**
+ * @brief qsort comparator ordering PathCounts by descending count, empty slots last.
+ */
+int comparePathCounts(const void *a, const void *b) {
+    const PathCount *left = a;
+    const PathCount *right = b;
+    if (left->count != right->count) {
+        return left->count < right->count ? 1 : -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Extract the request path from one line of a prewarm source.
+ *
+ * Two formats are understood: access log lines, where the path is the second word of
+ * the quoted request line, and capture files listing one path per line.
+ *
+ * @param line The line, modified in place.
+ * @return The path within line, or NULL if the line holds none.
+ */
+char *extractLoggedPath(char *line) {
+    char *request = strchr(line, '"');
+    char *path;
+    if (request != NULL) {
+        char *saveptr;
+        strtok_r(request + 1, " \"", &saveptr); // Method
+        path = strtok_r(NULL, " \"", &saveptr);
+    } else {
+        path = line + strspn(line, " \t");
+        path[strcspn(path, " \t\r\n")] = '\0';
+    }
+    return (path != NULL && path[0] == '/') ? path : NULL;
+}
+
+/**
+ * @brief Arguments of the prewarm thread.
+ */
+typedef struct {
+    const char *source; ///< Access log or capture file to read paths from.
+    int count;          ///< Maximum number of distinct paths to preload.
+} PrewarmJob;
+
+/**
+ * @brief Thread body: preload the most requested paths of a previous run into the file cache.
+ *
+ * The source is read once to count requests per path; the top paths are then routed
+ * like real GET requests and loaded through fileCacheAcquire(). Loading goes through the
+ * same shared cache the request loop uses, so traffic can be served while this runs.
+ *
+ * @param argument A heap-allocated PrewarmJob, freed by the thread.
+ * @return NULL.
+ */
+void *prewarmFileCache(void *argument) {
+    PrewarmJob *job = argument;
+    PathCounter counter = {NULL, 0, 0};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    FILE *source = fopen(job->source, "r");
+    if (source == NULL) {
+        fprintf(stderr, "Prewarm: cannot open %s: %s\n", job->source, strerror(errno));
+        free(job);
+        return NULL;
+    }
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, source) != -1) {
+        char *path = extractLoggedPath(line);
+        if (path != NULL && countPath(&counter, path) == -1) {
+            break;
+        }
+    }
+    free(line);
+    fclose(source);
+
+    int loaded = 0;
+    if (counter.used > 0) {
+        qsort(counter.slots, counter.capacity, sizeof(PathCount), comparePathCounts);
+        for (size_t i = 0; i < counter.used && loaded < job->count; i++) {
+            const RouteMapping *route = findGetRoute(counter.slots[i].path);
+            if (route == NULL) {
+                continue;
+            }
+            // Seed the admission filter with the popularity seen in the log
+            uint64_t hash = hashString(route->link);
+            for (size_t n = 1; n < counter.slots[i].count && n < SKETCH_MAX_COUNT; n++) {
+                sketchIncrement(&fileCache.index->sketch, hash);
+            }
+            FileCacheHandle handle;
+            if (fileCacheAcquire(&fileCache, route->link, &handle) == 0) {
+                loaded++;
+            }
+            fileCacheRelease(&handle);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Prewarm: loaded %d of %zu distinct paths from %s in %ld ms\n", loaded, counter.used, job->source,
+           (end.tv_sec - start.tv_sec) * 1000L + (end.tv_nsec - start.tv_nsec) / 1000000);
+
+    for (size_t i = 0; i < counter.capacity; i++) {
+        free(counter.slots[i].path);
+    }
+    free(counter.slots);
+    free(job);
+    return NULL;
+}
+
+/**
+ * @brief Start prewarmFileCache() on a detached background thread.
+ *
+ * @param source The access log or capture file to read.
+ * @param count Maximum number of distinct paths to preload.
+ * @return 0 if the thread was started, -1 otherwise.
+ */
+int startCachePrewarm(const char *source, int count) {
+    if (fileCache.index == NULL) {
+        return -1;
+    }
+    PrewarmJob *job = malloc(sizeof(PrewarmJob));
+    if (job == NULL) {
+        return -1;
+    }
+    job->source = source;
+    job->count = count;
+
+    pthread_t thread;
+    int result = pthread_create(&thread, NULL, prewarmFileCache, job);
+    if (result != 0) {
+        fprintf(stderr, "Prewarm: cannot start thread: %s\n", strerror(result));
+        free(job);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * @brief Replay the requests of an access log or capture file against the file cache.
+ *
+ * Every routed GET in the source is looked up exactly as the request loop would, and
+ * the resulting hit ratio and admission counters are printed. Combined with
+ * --cache-size this shows how a cache configuration copes with real traffic.
+ *
+ * @param source The access log or capture file to replay.
+ * @return 0 on success, -1 if the source could not be read.
+ */
+int replayAccessLog(const char *source) {
+    FILE *file = fopen(source, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Replay: cannot open %s: %s\n", source, strerror(errno));
+        return -1;
+    }
+
+    size_t requests = 0, unrouted = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, file) != -1) {
+        char *path = extractLoggedPath(line);
+        if (path == NULL) {
+            continue;
+        }
+        requests++;
+        const RouteMapping *route = findGetRoute(path);
+        FileCacheHandle handle;
+        if (route == NULL) {
+            unrouted++;
+        } else {
+            fileCacheAcquire(&fileCache, route->link, &handle);
+            fileCacheRelease(&handle);
+        }
+    }
+    free(line);
+    fclose(file);
+
+    printf("Replayed %zu requests from %s (%zu without a route)\n", requests, source, unrouted);
+    printFileCacheStats(&fileCache);
+    return 0;
+}
+
+//------------------------------------------------------------------
+/**
+ * @brief Enable kernel busy polling on a socket when a busy-poll budget is configured.
+ *
+ * With SO_BUSY_POLL set, blocking reads and epoll_wait on the socket poll the device
+ * queue for up to the given number of microseconds instead of sleeping until an
+ * interrupt arrives. Raising the value above net.core.busy_read needs CAP_NET_ADMIN;
+ * failures are reported once and otherwise ignored, since busy polling is only an
+ * optimisation.
+ *
+ * @param socket_fd The socket to configure.
+ */
+void configureBusyPoll(int socket_fd) {
+    static int warned = 0;
+    if (serverOptions.busy_poll_usec <= 0) {
+        return;
+    }
+#ifdef SO_BUSY_POLL
+    int usec = serverOptions.busy_poll_usec;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1 && !warned) {
+        fprintf(stderr, "Warning: SO_BUSY_POLL not applied: %s\n", strerror(errno));
+        warned = 1;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+#else
+    (void)socket_fd;
+    if (!warned) {
+        fprintf(stderr, "Warning: SO_BUSY_POLL is not supported on this platform\n");
+        warned = 1;
+    }
+#endif
+}
+
+/**
+ * @brief Wait until one of the listening sockets registered with epoll_fd is readable.
+ *
+ * When a spin budget is configured the loop first polls epoll without sleeping until
+ * an event shows up or the budget is exhausted, and only then falls back to a
+ * blocking epoll_wait. Spinning keeps the thread on the CPU so a new connection is
+ * picked up without the wakeup latency of the scheduler.
+ *
+ * @param epoll_fd The epoll instance the listeners are registered with.
+ * @param event Receives the event of the listener that is ready.
+ * @return The number of ready events (> 0), or -1 on error with errno set.
+ */
+int waitForConnection(int epoll_fd, struct epoll_event *event) {
+    if (serverOptions.spin_budget_usec > 0) {
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long elapsed_usec = 0;
+        while (elapsed_usec < serverOptions.spin_budget_usec) {
+            int ready = epoll_wait(epoll_fd, event, 1, 0);
+            if (ready != 0) {
+                return ready;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed_usec = (now.tv_sec - start.tv_sec) * 1000000L +
+                           (now.tv_nsec - start.tv_nsec) / 1000;
+        }
+    }
+
+    return epoll_wait(epoll_fd, event, 1, -1);
+}
+
+/**
+ * @brief Set when SIGINT or SIGTERM asks the server to shut down.
+ */
+volatile sig_atomic_t stopRequested = 0;
+
+/**
+ * @brief Set by SIGALRM when a periodic cache snapshot is due.
+ */
+volatile sig_atomic_t snapshotDue = 0;
+
+/**
+ * @brief Signal handler recording a shutdown request.
+ */
+void handleStopSignal(int signal_number) {
+    (void)signal_number;
+    stopRequested = 1;
+}
+
+/**
+ * @brief Signal handler recording that a periodic snapshot is due.
+ */
+void handleSnapshotSignal(int signal_number) {
+    (void)signal_number;
+    snapshotDue = 1;
+}
+
+/**
+ * @brief Install handleStopSignal for SIGINT and SIGTERM, and handleSnapshotSignal for SIGALRM.
+ *
+ * SA_RESTART is deliberately not set for the stop signals so that blocking calls such as
+ * epoll_wait and waitpid return with EINTR and the loops get to check stopRequested.
+ * SIGALRM gets SA_RESTART when this process also serves connections: a snapshot falling
+ * due must not abort the recv() or send() of a request in flight, and epoll_wait still
+ * returns EINTR (it is never restarted), so the loop notices snapshotDue all the same.
+ * The prefork master keeps it interruptible so that waitpid wakes up for the snapshot.
+ *
+ * @param serves_connections Whether this process runs the request loop itself.
+ */
+void installStopHandlers(int serves_connections) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleStopSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = handleSnapshotSignal;
+    action.sa_flags = serves_connections ? SA_RESTART : 0;
+    sigaction(SIGALRM, &action, NULL);
+}
+
+/**
+ * @brief Save the cache snapshot if the periodic timer fired, and re-arm the timer.
+ *
+ * Only the process that armed the timer (the single process, or the prefork master)
+ * ever sees snapshotDue set, since alarms are not inherited across fork().
+ */
+void servicePeriodicSnapshot(void) {
+    if (!snapshotDue) {
+        return;
+    }
+    snapshotDue = 0;
+    if (serverOptions.cache_snapshot != NULL) {
+        saveCacheSnapshot(&fileCache, serverOptions.cache_snapshot);
+    }
+    alarm(serverOptions.snapshot_interval);
+}
+
+/**
+ * @brief Parse a listen address and add it to the listeners.
+ *
+ * Accepted forms are "1.2.3.4:80", "[::1]:80", "[::]:80" (dual-stack: IPv6 and IPv4
+ * clients on one socket) and "unix:/run/server.sock". Unix sockets skip the TCP stack
+ * entirely, which makes them the cheaper choice for a proxy on the same host.
+ *
+ * A "@<policy>" suffix, as in "127.0.0.1:9100@admin", selects the listener's policy;
+ * without one the listener gets the public policy.
+ *
+ * @param spec The address. It must stay valid for the lifetime of the server.
+ * @return 0 on success, -1 if the address is invalid or there are too many listeners.
+ */
+int addListener(const char *spec) {
+    if (listenerCount == MAX_LISTENERS) {
+        return -1;
+    }
+    Listener *listener = &listeners[listenerCount];
+    memset(listener, 0, sizeof(*listener));
+    listener->spec = spec;
+    listener->policy = &publicPolicy;
+    listener->fd = -1;
+
+    size_t spec_length = strlen(spec);
+    const char *at = strrchr(spec, '@');
+    for (size_t i = 0; at != NULL && i < sizeof(listenerPolicies) / sizeof(listenerPolicies[0]); i++) {
+        if (strcmp(at + 1, listenerPolicies[i]->name) == 0) {
+            listener->policy = listenerPolicies[i];
+            spec_length = at - spec;
+        }
+    }
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *address = (struct sockaddr_un *)&listener->address;
+        size_t path_length = spec_length - 5;
+        if (path_length == 0 || path_length >= sizeof(address->sun_path)) {
+            return -1;
+        }
+        address->sun_family = AF_UNIX;
+        memcpy(address->sun_path, spec + 5, path_length);
+        listener->address_length = sizeof(*address);
+        listenerCount++;
+        return 0;
+    }
+
+    const char *port_separator = memrchr(spec, ':', spec_length);
+    if (port_separator == NULL) {
+        return -1;
+    }
+    char *end;
+    long port = strtol(port_separator + 1, &end, 10);
+    if (port <= 0 || port > 65535 || end != spec + spec_length) {
+        return -1;
+    }
+    char host[INET6_ADDRSTRLEN];
+    size_t host_length = port_separator - spec;
+    if (host_length >= 2 && spec[0] == '[' && spec[host_length - 1] == ']') {
+        struct sockaddr_in6 *address = (struct sockaddr_in6 *)&listener->address;
+        snprintf(host, sizeof(host), "%.*s", (int)(host_length - 2), spec + 1);
+        if (host_length - 2 >= sizeof(host) || inet_pton(AF_INET6, host, &address->sin6_addr) != 1) {
+            return -1;
+        }
+        address->sin6_family = AF_INET6;
+        address->sin6_port = htons(port);
+        listener->address_length = sizeof(*address);
+    } else {
+        struct sockaddr_in *address = (struct sockaddr_in *)&listener->address;
+        snprintf(host, sizeof(host), "%.*s", (int)host_length, spec);
+        if (host_length >= sizeof(host) || inet_pton(AF_INET, host, &address->sin_addr) != 1) {
+            return -1;
+        }
+        address->sin_family = AF_INET;
+        address->sin_port = htons(port);
+        listener->address_length = sizeof(*address);
+    }
+    listenerCount++;
+    return 0;
+}
+
+/**
+ * @brief Create the listening socket of a listener.
+ *
+ * The socket is bound, listening and non-blocking, so that a wakeup which loses the
+ * race for a connection (to another worker, or a spurious one) never parks the loop
+ * inside accept().
+ *
+ * @param listener The listener; its fd is set on success.
+ * @return The listening socket, or -1 on failure.
+ */
+int createServerSocket(Listener *listener) {
+    int family = listener->address.ss_family;
+    int server_socket = socket(family, SOCK_STREAM, 0);
+    if (server_socket == -1) {
+        fprintf(stderr, "Failed to create server socket for %s\n", listener->spec);
+        return -1;
+    }
+
+    if (family == AF_UNIX) {
+        // Replace the socket file left behind by a previous run, but never a regular file
+        const char *path = ((struct sockaddr_un *)&listener->address)->sun_path;
+        struct stat path_stat;
+        if (lstat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+            unlink(path);
+        }
+    } else {
+        // Allow a restarted server to bind while old connections linger in TIME_WAIT
+        int reuse = 1;
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (family == AF_INET6) {
+        // [::] accepts IPv4 clients too, whatever the system default says
+        int v6only = 0;
+        setsockopt(server_socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+
+    if (bind(server_socket, (struct sockaddr *)&listener->address, listener->address_length) == -1) {
+        fprintf(stderr, "Failed to bind server socket to %s: %s\n", listener->spec, strerror(errno));
         close(server_socket);
         return -1;
     }
-    printf("\nServer Listening\n");
-    struct sockaddr_in client_address;
+
+    // Listen for incoming connections
+    if (listen(server_socket, 128) == -1) {
+        fprintf(stderr, "Failed to listen on server socket\n");
+        close(server_socket);
+        return -1;
+    }
+
+    int flags = fcntl(server_socket, F_GETFL, 0);
+    if (flags == -1 || fcntl(server_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+        fprintf(stderr, "Failed to make server socket non-blocking: %s\n", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+    configureBusyPoll(server_socket);
+    listener->fd = server_socket;
+    return server_socket;
+}
+
+/**
+ * @brief Close every listener, removing the socket files of Unix listeners.
+ */
+void closeListeners(void) {
+    for (int i = 0; i < listenerCount; i++) {
+        if (listeners[i].fd == -1) {
+            continue;
+        }
+        close(listeners[i].fd);
+        listeners[i].fd = -1;
+        if (listeners[i].address.ss_family == AF_UNIX) {
+            unlink(((struct sockaddr_un *)&listeners[i].address)->sun_path);
+        }
+    }
+}
+
+/**
+ * @brief Accept and answer connections on every listener until a shutdown is requested.
+ *
+ * This is the request loop run by the single process in the default mode and by every
+ * worker in prefork mode. Each call creates its own epoll instance; the listeners are
+ * registered with EPOLLEXCLUSIVE so a new connection wakes one worker, not all of them.
+ *
+ * @return 0 on a requested shutdown, -1 if the loop could not be set up.
+ */
+int runWorkerLoop(void) {
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        fprintf(stderr, "Failed to create epoll instance: %s\n", strerror(errno));
+        return -1;
+    }
+    struct epoll_event event;
+    for (int i = 0; i < listenerCount; i++) {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.u32 = i;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listeners[i].fd, &event) == -1) {
+            fprintf(stderr, "Failed to register server socket: %s\n", strerror(errno));
+            close(epoll_fd);
+            return -1;
+        }
+    }
+
+    struct sockaddr_storage client_address;
     socklen_t client_address_length = sizeof(client_address);
+    clock_gettime(CLOCK_MONOTONIC, &workerLoad.since);
+    attachWorkerMetrics();
+    claimConnectionSlot();
+    tracedConnection.id = (uint64_t)(uint32_t)time(NULL) << 32 | (uint64_t)workerId << 24;
 
-    while (1) {
+    while (!stopRequested) {
+        servicePeriodicSnapshot();
         // Accept incoming connections
         printf("\n---------Waiting for new connection---------\n\n");
+        if (waitForConnection(epoll_fd, &event) == -1) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Error waiting for connections: %s\n", strerror(errno));
+            }
+            continue;
+        }
+        const Listener *listener = &listeners[event.data.u32];
+        client_address_length = sizeof(client_address);
         int client_socket =
-            accept(server_socket, (struct sockaddr *)&client_address,
+            accept(listener->fd, (struct sockaddr *)&client_address,
                    &client_address_length);
         if (client_socket == -1) {
-            fprintf(stderr, "Error accepting client connection: %s\n",
-                    strerror(errno));
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Error accepting client connection: %s\n",
+                        strerror(errno));
+            }
             continue;
         }
         printf("Connection Established\n");
-        // Receive and process HTTP requests
-        char buffer[30000] = {0};
-        ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
+        chargeWorkerTime(0);
+        beginConnectionTrace();
+        openConnectionSlot(client_socket, &client_address);
+        PROBE(accept, tracedConnection.id, client_socket, listener->spec);
+        if (workerMetrics != NULL) {
+            addMetric(&workerMetrics->connections, 1);
+        }
+        configureBusyPoll(client_socket);
+        handleClientConnection(client_socket, listener, &client_address);
+        recordConnectionMetrics(chargeWorkerTime(1));
+    }
 
-        if (bytes_received == -1) {
-            fprintf(stderr, "Error receiving data: %s\n", strerror(errno));
-            close(client_socket);
-            continue;
+    close(epoll_fd);
+    return 0;
+}
+
+//------------------------------------------------------------------
+#define WORKER_RESPAWN_DELAY_SECONDS 1
+
+/**
+ * @brief Fork a worker process that runs the request loop on the listeners.
+ *
+ * The child asks to be sent SIGTERM if the master goes away, so workers never outlive
+ * their supervisor.
+ *
+ * @param id The worker index, stored in workerId in the child.
+ * @return The child's pid in the master, or -1 if fork failed. Never returns in the child.
+ */
+pid_t spawnWorker(int id) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid == -1) {
+            fprintf(stderr, "Failed to fork worker %d: %s\n", id, strerror(errno));
         }
-        printf("Received Data:\n");
-        printStringWithEscapeChars(buffer);
-        HttpRequest *http = parseHttpRequest(buffer);
-        handleHttpRequest(client_socket, http);
+        return pid;
+    }
 
-        // Clean up resources
-        close(client_socket);
-        free(http);
+    workerId = id;
+    useWorkerFileCachePins(&fileCache, id);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) {
+        // The master died before prctl took effect
+        _exit(EXIT_SUCCESS);
+    }
+    int result = runWorkerLoop();
+    fflush(stdout);
+    _exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * @brief Run the prefork master: start the workers and restart any that die.
+ *
+ * Every worker has a private heap and its own copy of everything but the shared file
+ * cache, so a handler that crashes takes down only its worker, which is replaced. A
+ * worker that dies right after being started is restarted after a short delay so a
+ * persistent failure does not turn into a fork loop.
+ *
+ * @param worker_count Number of worker processes to keep running.
+ * @return 0 after a requested shutdown.
+ */
+int superviseWorkers(int worker_count) {
+    pid_t workers[MAX_WORKERS] = {0};
+    time_t started_at[MAX_WORKERS] = {0};
+
+    for (int i = 0; i < worker_count; i++) {
+        workers[i] = spawnWorker(i);
+        started_at[i] = time(NULL);
     }
+    printf("Master %d supervising %d workers\n", (int)getpid(), worker_count);
+
+    while (!stopRequested) {
+        servicePeriodicSnapshot();
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == ECHILD) {
+                // Every fork failed; try again after a pause
+                sleep(WORKER_RESPAWN_DELAY_SECONDS);
+            } else if (errno != EINTR) {
+                fprintf(stderr, "Error waiting for workers: %s\n", strerror(errno));
+            }
+        }
 
-    // Clean up the server socket
-    close(server_socket);
+        for (int i = 0; i < worker_count && !stopRequested; i++) {
+            if (pid > 0 && workers[i] == pid) {
+                if (WIFSIGNALED(status)) {
+                    fprintf(stderr, "Worker %d (pid %d) killed by signal %d, restarting\n",
+                            i, (int)pid, WTERMSIG(status));
+                } else {
+                    fprintf(stderr, "Worker %d (pid %d) exited with status %d, restarting\n",
+                            i, (int)pid, WEXITSTATUS(status));
+                }
+                workers[i] = 0;
+                size_t dropped = dropWorkerFileCachePins(&fileCache, i);
+                if (dropped > 0) {
+                    fprintf(stderr, "Released %zu file cache pins held by worker %d\n", dropped, i);
+                }
+                if (time(NULL) - started_at[i] < WORKER_RESPAWN_DELAY_SECONDS) {
+                    sleep(WORKER_RESPAWN_DELAY_SECONDS);
+                }
+            }
+            if (workers[i] <= 0) {
+                workers[i] = spawnWorker(i);
+                started_at[i] = time(NULL);
+            }
+        }
+    }
 
+    // Shut the workers down and reap them
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i] > 0) {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+    }
     return 0;
 }
 
+/**
+ * @brief Start an HTTP server that listens on every configured listener.
+ *
+ * This function creates a socket for each listener, binds it and listens for incoming
+ * connections. With serverOptions.workers set to 0 the connections are handled in this
+ * process; otherwise this process becomes a master that forks that many workers, each
+ * accepting from all of the shared listening sockets.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int startHttpServer(void) {
+    for (int i = 0; i < listenerCount; i++) {
+        if (createServerSocket(&listeners[i]) == -1) {
+            closeListeners();
+            return -1;
+        }
+    }
+    installStopHandlers(serverOptions.workers == 0);
+
+    printf("\nServer Listening\n");
+    for (int i = 0; i < listenerCount; i++) {
+        printf("Listening on %s (%s)\n", listeners[i].spec, listeners[i].policy->name);
+    }
+    if (serverOptions.spin_budget_usec > 0) {
+        printf("Busy polling enabled: SO_BUSY_POLL=%dus, spin budget=%dus\n",
+               serverOptions.busy_poll_usec, serverOptions.spin_budget_usec);
+    }
+
+    if (serverOptions.cache_snapshot != NULL && serverOptions.snapshot_interval > 0) {
+        alarm(serverOptions.snapshot_interval);
+    }
+
+    int result;
+    if (serverOptions.workers > 0) {
+        result = superviseWorkers(serverOptions.workers);
+    } else {
+        result = runWorkerLoop();
+    }
+
+    printFileCacheStats(&fileCache);
+    if (serverOptions.cache_snapshot != NULL) {
+        alarm(0);
+        int saved = saveCacheSnapshot(&fileCache, serverOptions.cache_snapshot);
+        if (saved >= 0) {
+            printf("Saved %d cached files to %s\n", saved, serverOptions.cache_snapshot);
+        }
+    }
+
+    // Clean up the server sockets
+    closeListeners();
+
+    return result;
+}
+
+/**
+ * @brief Print command line usage, including the optional tuning flags.
+ *
+ * @param program The program name (argv[0]).
+ */
+void printUsage(const char *program) {
+    fprintf(stderr, "Usage: %s <IP address> <port> [options]\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --listen=<address>[@admin]  Also listen on ip:port, [ipv6]:port ([::] is dual-stack) or unix:/path;\n");
+    fprintf(stderr, "                        @admin serves /metrics, /debug/listeners and /debug/connections instead of the site\n");
+    fprintf(stderr, "  --busy-poll=<usec>    Busy poll sockets for up to <usec> (SO_BUSY_POLL)\n");
+    fprintf(stderr, "  --spin-budget=<usec>  Spin on epoll for <usec> before blocking (default: busy-poll value)\n");
+    fprintf(stderr, "  --cache-size=<MB>     Size of the static file cache (default: 64, 0 disables)\n");
+    fprintf(stderr, "  --no-huge-pages       Do not back the file cache and buffers with huge pages\n");
+    fprintf(stderr, "  --workers=<n>         Prefork <n> worker processes under a supervising master\n");
+    fprintf(stderr, "  --cache-snapshot=<file>    Restore the file cache from <file> at startup, save it on shutdown\n");
+    fprintf(stderr, "  --snapshot-interval=<sec>  Also save the cache snapshot every <sec> seconds\n");
+    fprintf(stderr, "  --access-log=<file>        Append requests to <file> in Common Log Format\n");
+    fprintf(stderr, "  --prewarm-from=<file>      Preload the most requested paths of an access log or path list\n");
+    fprintf(stderr, "  --prewarm-count=<n>        Number of distinct paths to preload (default: 100)\n");
+    fprintf(stderr, "  --replay=<file>            Replay an access log against the file cache, report the hit ratio and exit\n");
+    fprintf(stderr, "  --max-uri=<bytes>          Longest request path accepted (default: 2048)\n");
+    fprintf(stderr, "  --max-header-size=<bytes>  Largest request header block accepted (default: 16384)\n");
+    fprintf(stderr, "  --max-headers=<n>          Most request headers accepted (default: 64)\n");
+    fprintf(stderr, "  --max-body=<bytes>         Largest request body accepted (default: 4096)\n");
+    fprintf(stderr, "  --templates=<dir>          Compile and serve the *.tmpl files in <dir> (default: ./public_html)\n");
+    fprintf(stderr, "  --minify                   Strip whitespace from HTML, CSS and JavaScript as they are loaded\n");
+    fprintf(stderr, "  --archive=<file.tar>       Serve the files in an uncompressed tar archive\n");
+    fprintf(stderr, "  --early-hints              Send 103 Early Hints preloading the CSS and JS of HTML pages\n");
+    fprintf(stderr, "  --metrics-file=<path>      Keep counters in a shared file that server-stats reads (e.g. /dev/shm/server.metrics)\n");
+    fprintf(stderr, "  --degraded-load=<percent>  Busy share at which " HEALTH_CHECK_PATH " answers 503 (default 90, 0 = never)\n");
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <IP address> <port>\n", argv[0]);
+    if (argc < 3) {
+        printUsage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    const char* ipAddressStr = argv[1];
-    const char* portStr = argv[2];
+    // The positional address is the first listener; an IPv6 address needs brackets in a listen spec
+    static char primary_listener[INET6_ADDRSTRLEN + 16];
+    snprintf(primary_listener, sizeof(primary_listener), strchr(argv[1], ':') != NULL ? "[%s]:%s" : "%s:%s",
+             argv[1], argv[2]);
+    if (addListener(primary_listener) == -1) {
+        fprintf(stderr, "Invalid IP address or port: %s %s\n", argv[1], argv[2]);
+        return EXIT_FAILURE;
+    }
 
-    struct in_addr addr;
-    if (inet_pton(AF_INET, ipAddressStr, &addr) != 1) {
-        fprintf(stderr, "Invalid IP address: %s\n", ipAddressStr);
+    for (int i = 3; i < argc; i++) {
+        if (parseServerOption(argv[i]) == -1) {
+            fprintf(stderr, "Invalid option: %s\n", argv[i]);
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < serverOptions.listen_count; i++) {
+        if (addListener(serverOptions.listen[i]) == -1) {
+            fprintf(stderr, "Invalid listen address: %s\n", serverOptions.listen[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (serverOptions.spin_budget_usec < 0) {
+        serverOptions.spin_budget_usec = serverOptions.busy_poll_usec;
+    }
+    // The header table is carved from the part of the connection buffer not used for receiving
+    if (serverOptions.max_header_size < 256 ||
+        (size_t)serverOptions.max_header_size + 1 + serverOptions.max_headers * sizeof(HttpHeader) + 8 > CONNECTION_BUFFER_SIZE) {
+        fprintf(stderr, "--max-header-size and --max-headers must fit a %d byte connection buffer\n",
+                CONNECTION_BUFFER_SIZE);
         return EXIT_FAILURE;
     }
+    publicPolicy.max_uri_length = serverOptions.max_uri_length;
+    publicPolicy.max_header_size = serverOptions.max_header_size;
+    publicPolicy.max_headers = serverOptions.max_headers;
+    publicPolicy.max_body_size = serverOptions.max_body_size;
+    if (serverOptions.workers > MAX_WORKERS) {
+        fprintf(stderr, "Too many workers (maximum %d)\n", MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+
+    if (initFileCache(&fileCache, serverOptions.cache_size_mb) == -1) {
+        fprintf(stderr, "Warning: file cache disabled\n");
+    } else if (fileCache.index != NULL) {
+        printf("File cache: %d MB on %s\n", serverOptions.cache_size_mb,
+               pageBackingName(fileCache.region.backing));
+        if (serverOptions.cache_snapshot != NULL) {
+            loadCacheSnapshot(&fileCache, serverOptions.cache_snapshot);
+        }
+        if (serverOptions.replay_source != NULL) {
+            return replayAccessLog(serverOptions.replay_source) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (serverOptions.prewarm_source != NULL) {
+            startCachePrewarm(serverOptions.prewarm_source, serverOptions.prewarm_count);
+        }
+    }
+    if (initBufferPool(&bufferPool) == 0) {
+        printf("Buffer pool: %d x %d bytes on %s\n", CONNECTION_BUFFER_COUNT,
+               CONNECTION_BUFFER_SIZE, pageBackingName(bufferPool.region.backing));
+    }
 
-    unsigned short port = atoi(portStr);
-    if (port <= 0 || port > 65534) {
-        fprintf(stderr, "Invalid port number: %s\n", portStr);
+    if (serverOptions.archive != NULL) {
+        if (openSiteArchive(&siteArchive, serverOptions.archive) == -1) {
+            return EXIT_FAILURE;
+        }
+        printf("Archive: %zu files indexed from %s\n", siteArchive.count, serverOptions.archive);
+    }
+    int compiled = loadTemplates(serverOptions.template_dir);
+    if (compiled > 0) {
+        printf("Templates: %d compiled from %s\n", compiled, serverOptions.template_dir);
+    }
+
+    // Opened before forking so every worker appends to the same file
+    if (serverOptions.access_log != NULL && openAccessLog(serverOptions.access_log) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (initConnectionTable(serverOptions.workers > 0 ? serverOptions.workers : 1) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (serverOptions.metrics_file != NULL &&
+        openMetricsFile(serverOptions.metrics_file, serverOptions.workers > 0 ? serverOptions.workers : 1) == -1) {
         return EXIT_FAILURE;
     }
 
-    int result = startHttpServer(addr.s_addr, htons(port));
+    int result = startHttpServer();
     if (result == -1) {
         fprintf(stderr, "Failed to start HTTP server\n");
         return EXIT_FAILURE;
@@ -0,0 +1,78 @@
+/**
+ * @file server_metrics.h
+ * @brief Layout of the metrics file the server maps with --metrics-file.
+ *
+ * The file is a MetricsHeader followed by one WorkerMetrics slot per worker. Each worker
+ * is the only writer of its slot and updates it with plain relaxed stores, so counting
+ * costs no locked instructions and no shared cache lines; readers map the file read-only
+ * and sum the slots. Nothing goes through the server's sockets, so the numbers stay
+ * readable when the server is saturated.
+ *
+ * Any change to the layout must bump METRICS_VERSION.
+ */
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define METRICS_MAGIC 0x5254454d50545448ULL ///< "HTTPMETR" in little-endian byte order.
+#define METRICS_VERSION 1
+#define METRICS_MAX_WORKERS 256
+#define METRICS_STATUS_CLASSES 6    ///< [0] connections closed without a response, [1]..[5] 1xx..5xx.
+#define METRICS_LATENCY_BUCKETS 24  ///< Bucket i counts connections handled in under 2^i microseconds.
+
+/**
+ * @brief Counters of one worker process.
+ *
+ * Slots are cache-line aligned so workers never write to the same line.
+ */
+typedef struct {
+    _Alignas(64) _Atomic uint64_t pid;                        ///< Pid of the worker currently using the slot.
+    _Atomic uint64_t connections;                             ///< Connections accepted.
+    _Atomic uint64_t responses[METRICS_STATUS_CLASSES];       ///< Requests by status class of the response.
+    _Atomic uint64_t health_checks;                           ///< Health checks answered on the fast path.
+    _Atomic uint64_t bytes_received;                          ///< Request header and body bytes.
+    _Atomic uint64_t bytes_sent;                              ///< Response body bytes.
+    _Atomic uint64_t busy_nsec;                               ///< Time spent handling connections.
+    _Atomic uint64_t load_permille;                           ///< Recent busy share of the worker (0-1000).
+    _Atomic uint64_t latency[METRICS_LATENCY_BUCKETS];        ///< Connection handling time histogram.
+} WorkerMetrics;
+
+/**
+ * @brief Counters of the shared file cache, mirrored about once a second by the workers.
+ */
+typedef struct {
+    _Atomic uint64_t hits;       ///< Lookups answered from memory.
+    _Atomic uint64_t misses;     ///< Lookups that had to read the file.
+    _Atomic uint64_t admissions; ///< Files added to the cache.
+    _Atomic uint64_t rejections; ///< Files the admission filter kept out.
+    _Atomic uint64_t evictions;  ///< Files evicted to make room.
+} CacheMetrics;
+
+/**
+ * @brief Start of the metrics file.
+ *
+ * magic is stored last when the server creates the file, so a reader that sees it can
+ * trust the rest of the header.
+ */
+typedef struct {
+    _Atomic uint64_t magic;  ///< METRICS_MAGIC once the file is initialised.
+    uint32_t version;        ///< METRICS_VERSION of the writer.
+    uint32_t header_size;    ///< Offset of the first slot from the start of the file.
+    uint32_t worker_size;    ///< sizeof(WorkerMetrics).
+    uint32_t worker_count;   ///< Number of slots that follow the header.
+    int64_t master_pid;      ///< Pid of the process that created the file.
+    int64_t started_at;      ///< Unix time the server started.
+    CacheMetrics cache;      ///< File cache counters.
+} MetricsHeader;
+
+/**
+ * @brief The whole metrics file.
+ */
+typedef struct {
+    MetricsHeader header;
+    WorkerMetrics workers[]; ///< header.worker_count slots.
+} MetricsSegment;
+
+#endif
@@ -0,0 +1,187 @@
+/**
+ * @file server_stats.c
+ * @brief Print the counters of a running server from its --metrics-file.
+ *
+ * The file is mapped read-only and never locked, so reading it costs the server nothing
+ * and works just as well when every worker is saturated.
+ *
+ * Usage: server-stats <metrics-file> [--workers]
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "server_metrics.h"
+
+/**
+ * @brief Read a counter written by a server worker.
+ */
+static uint64_t readMetric(const _Atomic uint64_t *counter) {
+    return atomic_load_explicit((_Atomic uint64_t *)counter, memory_order_relaxed);
+}
+
+/**
+ * @brief Map a metrics file and check that its layout is the one this tool understands.
+ *
+ * @param path The metrics file.
+ * @param size Receives the size of the mapping.
+ * @return The mapped file, or NULL after printing why it cannot be used.
+ */
+const MetricsSegment *openMetrics(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    *size = info.st_size;
+    if (*size < sizeof(MetricsHeader)) {
+        fprintf(stderr, "%s is not a metrics file\n", path);
+        close(fd);
+        return NULL;
+    }
+    const MetricsSegment *segment = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    const MetricsHeader *header = &segment->header;
+    const char *problem = NULL;
+    if (atomic_load_explicit((_Atomic uint64_t *)&header->magic, memory_order_acquire) != METRICS_MAGIC) {
+        problem = "is not a metrics file";
+    } else if (header->version != METRICS_VERSION || header->header_size != offsetof(MetricsSegment, workers) ||
+               header->worker_size != sizeof(WorkerMetrics)) {
+        problem = "was written by a different server version";
+    } else if (header->worker_count > METRICS_MAX_WORKERS ||
+               header->header_size + (size_t)header->worker_count * header->worker_size > *size) {
+        problem = "is truncated";
+    }
+    if (problem != NULL) {
+        fprintf(stderr, "%s %s\n", path, problem);
+        munmap((void *)segment, *size);
+        return NULL;
+    }
+    return segment;
+}
+
+/**
+ * @brief Add the counters of one worker slot to a running total.
+ */
+void addWorker(WorkerMetrics *total, const WorkerMetrics *worker) {
+    atomic_store(&total->connections, readMetric(&total->connections) + readMetric(&worker->connections));
+    for (int i = 0; i < METRICS_STATUS_CLASSES; i++) {
+        atomic_store(&total->responses[i], readMetric(&total->responses[i]) + readMetric(&worker->responses[i]));
+    }
+    atomic_store(&total->health_checks, readMetric(&total->health_checks) + readMetric(&worker->health_checks));
+    atomic_store(&total->bytes_received, readMetric(&total->bytes_received) + readMetric(&worker->bytes_received));
+    atomic_store(&total->bytes_sent, readMetric(&total->bytes_sent) + readMetric(&worker->bytes_sent));
+    atomic_store(&total->busy_nsec, readMetric(&total->busy_nsec) + readMetric(&worker->busy_nsec));
+    atomic_store(&total->load_permille, readMetric(&total->load_permille) + readMetric(&worker->load_permille));
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        atomic_store(&total->latency[i], readMetric(&total->latency[i]) + readMetric(&worker->latency[i]));
+    }
+}
+
+/**
+ * @brief Estimate a latency percentile from the histogram.
+ *
+ * @return The upper bound of the bucket holding the percentile, in microseconds
+ *         (0 if the histogram is empty).
+ */
+uint64_t latencyPercentile(const WorkerMetrics *metrics, double percentile) {
+    uint64_t count = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        count += readMetric(&metrics->latency[i]);
+    }
+    uint64_t rank = (uint64_t)(count * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS && count > 0; i++) {
+        seen += readMetric(&metrics->latency[i]);
+        if (seen >= rank && seen > 0) {
+            return 1ULL << i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Print the counters of one worker, or the sum of all of them.
+ */
+void printWorker(const char *label, const WorkerMetrics *metrics, int worker_count) {
+    uint64_t responses = 0;
+    for (int i = 1; i < METRICS_STATUS_CLASSES; i++) {
+        responses += readMetric(&metrics->responses[i]);
+    }
+    printf("%s\n", label);
+    printf("  connections     %llu\n", (unsigned long long)readMetric(&metrics->connections));
+    printf("  responses       %llu (1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu), %llu unanswered\n",
+           (unsigned long long)responses, (unsigned long long)readMetric(&metrics->responses[1]),
+           (unsigned long long)readMetric(&metrics->responses[2]), (unsigned long long)readMetric(&metrics->responses[3]),
+           (unsigned long long)readMetric(&metrics->responses[4]), (unsigned long long)readMetric(&metrics->responses[5]),
+           (unsigned long long)readMetric(&metrics->responses[0]));
+    printf("  health checks   %llu\n", (unsigned long long)readMetric(&metrics->health_checks));
+    printf("  bytes           %llu received, %llu sent\n", (unsigned long long)readMetric(&metrics->bytes_received),
+           (unsigned long long)readMetric(&metrics->bytes_sent));
+    printf("  busy            %.3f s, load %.1f%%\n", readMetric(&metrics->busy_nsec) / 1e9,
+           readMetric(&metrics->load_permille) / 10.0 / (worker_count > 0 ? worker_count : 1));
+    printf("  latency         p50 < %llu us, p90 < %llu us, p99 < %llu us\n",
+           (unsigned long long)latencyPercentile(metrics, 50), (unsigned long long)latencyPercentile(metrics, 90),
+           (unsigned long long)latencyPercentile(metrics, 99));
+}
+
+/**
+ * @brief Print the contents of a metrics file.
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2 || (argc == 3 && strcmp(argv[2], "--workers") != 0) || argc > 3) {
+        fprintf(stderr, "Usage: %s <metrics-file> [--workers]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int per_worker = argc == 3;
+    size_t size;
+    const MetricsSegment *segment = openMetrics(argv[1], &size);
+    if (segment == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    const MetricsHeader *header = &segment->header;
+    int running = kill((pid_t)header->master_pid, 0) == 0 || errno == EPERM;
+    long uptime = (long)(time(NULL) - header->started_at);
+    printf("server pid %lld (%s), started %ld s ago, %u worker%s\n", (long long)header->master_pid,
+           running ? "running" : "not running", uptime, header->worker_count, header->worker_count == 1 ? "" : "s");
+    printf("file cache        %llu hits, %llu misses, %llu admitted, %llu rejected, %llu evicted\n",
+           (unsigned long long)readMetric(&header->cache.hits), (unsigned long long)readMetric(&header->cache.misses),
+           (unsigned long long)readMetric(&header->cache.admissions),
+           (unsigned long long)readMetric(&header->cache.rejections),
+           (unsigned long long)readMetric(&header->cache.evictions));
+
+    WorkerMetrics total;
+    memset(&total, 0, sizeof(total));
+    for (uint32_t i = 0; i < header->worker_count; i++) {
+        addWorker(&total, &segment->workers[i]);
+    }
+    printWorker("all workers", &total, header->worker_count);
+    for (uint32_t i = 0; per_worker && i < header->worker_count; i++) {
+        char label[64];
+        snprintf(label, sizeof(label), "worker %u (pid %llu)", i,
+                 (unsigned long long)readMetric(&segment->workers[i].pid));
+        printWorker(label, &segment->workers[i], 1);
+    }
+
+    munmap((void *)segment, size);
+    return EXIT_SUCCESS;
+}